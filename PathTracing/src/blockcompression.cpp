@@ -0,0 +1,270 @@
+#include <emmintrin.h>
+#include <glm/glm.hpp>
+
+#include "blockcompression.h"
+
+// Divisions of small sums by 3, 5 and 7 as 16 bit fixed point multiplies, exact for the
+// interpolation sums of 8 bit endpoints
+const short DIV3 = 21846;
+const short DIV5 = 13108;
+const short DIV7 = 9363;
+
+namespace BlockCompression
+{
+	static const unsigned short PackRgb565(const glm::vec3& c)
+	{
+		int r = (int)(glm::clamp(c.r, 0.0f, 255.0f) * 31.0f / 255.0f + 0.5f);
+		int g = (int)(glm::clamp(c.g, 0.0f, 255.0f) * 63.0f / 255.0f + 0.5f);
+		int b = (int)(glm::clamp(c.b, 0.0f, 255.0f) * 31.0f / 255.0f + 0.5f);
+		return (unsigned short)((r << 11) | (g << 5) | b);
+	}
+
+	// The 4 RGBA8 colors a BC1 block indexes
+	static void ColorPalette(const unsigned char* block, bool allowTransparent, unsigned char* palette)
+	{
+		unsigned short c0 = block[0] | (block[1] << 8);
+		unsigned short c1 = block[2] | (block[3] << 8);
+		// c0 in the low half and c1 in the high half, one lane per channel
+		__m128i packed = _mm_cvtsi32_si128(c0 | (c1 << 16));
+		packed = _mm_unpacklo_epi16(packed, packed);
+		packed = _mm_unpacklo_epi32(packed, packed);
+		// Channels to the top bits, then replicated down to 8 bits by a fixed point multiply
+		__m128i masked = _mm_and_si128(packed, _mm_setr_epi16(
+			(short)0xF800, 0x07E0, 0x001F, 0, (short)0xF800, 0x07E0, 0x001F, 0));
+		masked = _mm_mullo_epi16(masked, _mm_setr_epi16(1, 1, 2048, 0, 1, 1, 2048, 0));
+		__m128i ends = _mm_mulhi_epu16(masked, _mm_setr_epi16(264, 8320, 264, 0, 264, 8320, 264, 0));
+		ends = _mm_or_si128(ends, _mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255));
+		__m128i swapped = _mm_shuffle_epi32(ends, _MM_SHUFFLE(1, 0, 3, 2));
+
+		__m128i mixed;
+		if (c0 > c1 || !allowTransparent)
+		{
+			// (2 * c0 + c1) / 3 and (c0 + 2 * c1) / 3
+			__m128i sum = _mm_add_epi16(_mm_add_epi16(ends, ends), swapped);
+			mixed = _mm_mulhi_epu16(sum, _mm_set1_epi16(DIV3));
+		}
+		else
+		{
+			// (c0 + c1) / 2 and transparent black
+			mixed = _mm_srli_epi16(_mm_add_epi16(ends, swapped), 1);
+			mixed = _mm_and_si128(mixed, _mm_setr_epi32(-1, -1, 0, 0));
+		}
+		_mm_storeu_si128((__m128i*)palette, _mm_packus_epi16(ends, mixed));
+	}
+
+	// The 8 values a BC4 block indexes
+	static void ValuePalette(const unsigned char* block, unsigned char* palette)
+	{
+		int a0 = block[0];
+		int a1 = block[1];
+		__m128i values;
+		if (a0 > a1)
+		{
+			__m128i sum = _mm_add_epi16(
+				_mm_mullo_epi16(_mm_set1_epi16((short)a0), _mm_setr_epi16(7, 0, 6, 5, 4, 3, 2, 1)),
+				_mm_mullo_epi16(_mm_set1_epi16((short)a1), _mm_setr_epi16(0, 7, 1, 2, 3, 4, 5, 6)));
+			values = _mm_mulhi_epu16(sum, _mm_set1_epi16(DIV7));
+		}
+		else
+		{
+			// The last two are 0 and 255
+			__m128i sum = _mm_add_epi16(
+				_mm_mullo_epi16(_mm_set1_epi16((short)a0), _mm_setr_epi16(5, 0, 4, 3, 2, 1, 0, 0)),
+				_mm_mullo_epi16(_mm_set1_epi16((short)a1), _mm_setr_epi16(0, 5, 1, 2, 3, 4, 0, 0)));
+			values = _mm_or_si128(_mm_mulhi_epu16(sum, _mm_set1_epi16(DIV5)), _mm_setr_epi16(0, 0, 0, 0, 0, 0, 0, 255));
+		}
+		_mm_storel_epi64((__m128i*)palette, _mm_packus_epi16(values, values));
+	}
+
+	static const int ColorIndex(const unsigned char* block, int texel)
+	{
+		return (block[4 + (texel >> 2)] >> ((texel & 3) * 2)) & 3;
+	}
+
+	static const int ValueIndex(const unsigned char* block, int texel)
+	{
+		// The 3 bit index may straddle two bytes
+		int bit = texel * 3;
+		int bits = block[2 + (bit >> 3)] | ((bit >> 3) < 5 ? block[3 + (bit >> 3)] << 8 : 0);
+		return (bits >> (bit & 7)) & 7;
+	}
+
+	static void EncodeColors(const unsigned char* rgba, unsigned char* block)
+	{
+		glm::vec3 colors[16];
+		glm::vec3 mean(0.0f);
+		glm::vec3 minColor(255.0f), maxColor(0.0f);
+		for (int i = 0; i < 16; i++)
+		{
+			colors[i] = glm::vec3(rgba[i * 4], rgba[i * 4 + 1], rgba[i * 4 + 2]);
+			mean += colors[i];
+			minColor = glm::min(minColor, colors[i]);
+			maxColor = glm::max(maxColor, colors[i]);
+		}
+		mean /= 16.0f;
+
+		// Principal axis by a few power iterations on the covariance, seeded with the box diagonal
+		float cov[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+		for (int i = 0; i < 16; i++)
+		{
+			glm::vec3 d = colors[i] - mean;
+			cov[0] += d.r * d.r;
+			cov[1] += d.r * d.g;
+			cov[2] += d.r * d.b;
+			cov[3] += d.g * d.g;
+			cov[4] += d.g * d.b;
+			cov[5] += d.b * d.b;
+		}
+		glm::vec3 axis = maxColor - minColor;
+		for (int k = 0; k < 4; k++)
+		{
+			axis = glm::vec3(
+				cov[0] * axis.r + cov[1] * axis.g + cov[2] * axis.b,
+				cov[1] * axis.r + cov[3] * axis.g + cov[4] * axis.b,
+				cov[2] * axis.r + cov[4] * axis.g + cov[5] * axis.b);
+			float len = glm::length(axis);
+			if (len <= 0.0f)
+				break;
+			axis /= len;
+		}
+
+		float tMin = 0.0f, tMax = 0.0f;
+		if (glm::length(axis) > 0.0f)
+		{
+			for (int i = 0; i < 16; i++)
+			{
+				float t = glm::dot(colors[i] - mean, axis);
+				tMin = glm::min(tMin, t);
+				tMax = glm::max(tMax, t);
+			}
+		}
+		unsigned short c0 = PackRgb565(mean + axis * tMax);
+		unsigned short c1 = PackRgb565(mean + axis * tMin);
+		// The order selects the 4 color mode
+		if (c0 < c1)
+		{
+			unsigned short c = c0;
+			c0 = c1;
+			c1 = c;
+		}
+		block[0] = c0 & 0xFF;
+		block[1] = c0 >> 8;
+		block[2] = c1 & 0xFF;
+		block[3] = c1 >> 8;
+
+		unsigned char palette[16];
+		ColorPalette(block, false, palette);
+		unsigned int indices = 0;
+		if (c0 != c1)
+		{
+			for (int i = 0; i < 16; i++)
+			{
+				int best = 0;
+				int bestDist = 0x7FFFFFFF;
+				for (int p = 0; p < 4; p++)
+				{
+					int dist = 0;
+					for (int k = 0; k < 3; k++)
+						dist += (rgba[i * 4 + k] - palette[p * 4 + k]) * (rgba[i * 4 + k] - palette[p * 4 + k]);
+					if (dist < bestDist)
+					{
+						best = p;
+						bestDist = dist;
+					}
+				}
+				indices |= (unsigned int)best << (i * 2);
+			}
+		}
+		for (int k = 0; k < 4; k++)
+			block[4 + k] = (indices >> (k * 8)) & 0xFF;
+	}
+
+	void EncodeBC1(const unsigned char* rgba, unsigned char* block)
+	{
+		EncodeColors(rgba, block);
+	}
+
+	void EncodeBC3(const unsigned char* rgba, unsigned char* block)
+	{
+		EncodeBC4(rgba + 3, 4, block);
+		EncodeColors(rgba, block + BC4_BLOCK_BYTES);
+	}
+
+	void EncodeBC4(const unsigned char* values, int stride, unsigned char* block)
+	{
+		int a0 = 0, a1 = 255;
+		for (int i = 0; i < 16; i++)
+		{
+			a0 = glm::max(a0, (int)values[i * stride]);
+			a1 = glm::min(a1, (int)values[i * stride]);
+		}
+		// a0 > a1 selects the 8 value mode
+		block[0] = (unsigned char)a0;
+		block[1] = (unsigned char)a1;
+
+		unsigned char palette[8];
+		ValuePalette(block, palette);
+		unsigned long long indices = 0;
+		if (a0 != a1)
+		{
+			for (int i = 0; i < 16; i++)
+			{
+				int best = 0;
+				int bestDist = 256;
+				for (int p = 0; p < 8; p++)
+				{
+					int dist = abs((int)values[i * stride] - (int)palette[p]);
+					if (dist < bestDist)
+					{
+						best = p;
+						bestDist = dist;
+					}
+				}
+				indices |= (unsigned long long)best << (i * 3);
+			}
+		}
+		for (int k = 0; k < 6; k++)
+			block[2 + k] = (indices >> (k * 8)) & 0xFF;
+	}
+
+	void EncodeBC5(const unsigned char* rg, int stride, unsigned char* block)
+	{
+		EncodeBC4(rg, stride, block);
+		EncodeBC4(rg + 1, stride, block + BC4_BLOCK_BYTES);
+	}
+
+	void DecodeBC1(const unsigned char* block, const int* texels, int count, unsigned char* rgba)
+	{
+		unsigned int palette[4];
+		ColorPalette(block, true, (unsigned char*)palette);
+		for (int i = 0; i < count; i++)
+			*(unsigned int*)(rgba + i * 4) = palette[ColorIndex(block, texels[i])];
+	}
+
+	void DecodeBC3(const unsigned char* block, const int* texels, int count, unsigned char* rgba)
+	{
+		unsigned int colors[4];
+		unsigned char alphas[8];
+		ColorPalette(block + BC4_BLOCK_BYTES, false, (unsigned char*)colors);
+		ValuePalette(block, alphas);
+		for (int i = 0; i < count; i++)
+		{
+			*(unsigned int*)(rgba + i * 4) = colors[ColorIndex(block + BC4_BLOCK_BYTES, texels[i])];
+			rgba[i * 4 + 3] = alphas[ValueIndex(block, texels[i])];
+		}
+	}
+
+	void DecodeBC4(const unsigned char* block, const int* texels, int count, unsigned char* r)
+	{
+		unsigned char palette[8];
+		ValuePalette(block, palette);
+		for (int i = 0; i < count; i++)
+			r[i * 4] = palette[ValueIndex(block, texels[i])];
+	}
+
+	void DecodeBC5(const unsigned char* block, const int* texels, int count, unsigned char* rg)
+	{
+		DecodeBC4(block, texels, count, rg);
+		DecodeBC4(block + BC4_BLOCK_BYTES, texels, count, rg + 1);
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef __BLOCKCOMPRESSION_H__
+#define __BLOCKCOMPRESSION_H__
+
+// BCn encoding of 4 x 4 texel blocks and decoding of single texels. The encoders are built
+// for load time rather than quality, endpoints are fitted along the block's principal axis.
+// Texels are numbered y * 4 + x within a block.
+namespace BlockCompression
+{
+	// 8 bytes, opaque RGB from 16 RGBA8 texels
+	const int BC1_BLOCK_BYTES = 8;
+	// 16 bytes, a BC4 alpha block followed by a BC1 color block
+	const int BC3_BLOCK_BYTES = 16;
+	// 8 bytes, one channel
+	const int BC4_BLOCK_BYTES = 8;
+	// 16 bytes, two BC4 blocks
+	const int BC5_BLOCK_BYTES = 16;
+
+	void EncodeBC1(const unsigned char* rgba, unsigned char* block);
+	void EncodeBC3(const unsigned char* rgba, unsigned char* block);
+	// values are stride bytes apart, e.g. 4 to compress one channel of RGBA texels
+	void EncodeBC4(const unsigned char* values, int stride, unsigned char* block);
+	void EncodeBC5(const unsigned char* rg, int stride, unsigned char* block);
+
+	// Decode count texels of one block, building its palette once. Decoded texels are written
+	// 4 bytes apart whatever their number of channels.
+	void DecodeBC1(const unsigned char* block, const int* texels, int count, unsigned char* rgba);
+	void DecodeBC3(const unsigned char* block, const int* texels, int count, unsigned char* rgba);
+	void DecodeBC4(const unsigned char* block, const int* texels, int count, unsigned char* r);
+	void DecodeBC5(const unsigned char* block, const int* texels, int count, unsigned char* rg);
+}
+
+#endif
@@ -0,0 +1,171 @@
+#include <math.h>
+#include <algorithm>
+#include <xmmintrin.h>
+
+#include <omp.h>
+
+#include "denoiser.h"
+
+// B3 spline taps of the 5x5 a-trous kernel
+const float ATROUS_KERNEL[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+// Normal weight is dot(n, n')^(2^NORMAL_SHARPNESS), evaluated by repeated squaring
+const int NORMAL_SHARPNESS = 7;
+
+Denoiser::Denoiser()
+{
+	mIterations = 5;
+	mColorSigma = 4.0f;
+	mDepthSigma = 0.1f;
+}
+
+const int Denoiser::GetIterations() const
+{
+	return mIterations;
+}
+
+void Denoiser::SetIterations(int iterations)
+{
+	mIterations = glm::clamp(iterations, 0, 8);
+}
+
+void Denoiser::FilterPass(const float* in, float* out, int step, int numThreads)
+{
+	const int w = mResolution.x;
+	const int h = mResolution.y;
+
+	#pragma omp parallel for num_threads(numThreads)
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			int p = y * w + x;
+			const float* cp = in + 4 * p;
+			const float* gp = &mGuide[4 * p];
+			float lumP = 0.2126f * cp[0] + 0.7152f * cp[1] + 0.0722f * cp[2];
+			float invSigmaL = 1.0f / (mColorSigma * sqrtf(glm::max(cp[3], 0.0f)) + 1e-4f);
+			float invSigmaZ = 1.0f / (mDepthSigma * step * glm::max(gp[3], 1e-3f));
+			bool hasNormal = gp[0] != 0.0f || gp[1] != 0.0f || gp[2] != 0.0f;
+
+			__m128 acc = _mm_setzero_ps();
+			float weightSum = 0.0f;
+			for (int dy = -2; dy <= 2; dy++)
+			{
+				int qy = y + dy * step;
+				if (qy < 0 || qy >= h)
+					continue;
+				for (int dx = -2; dx <= 2; dx++)
+				{
+					int qx = x + dx * step;
+					if (qx < 0 || qx >= w)
+						continue;
+
+					int q = qy * w + qx;
+					const float* cq = in + 4 * q;
+					const float* gq = &mGuide[4 * q];
+
+					float wN = 1.0f;
+					bool hasNormalQ = gq[0] != 0.0f || gq[1] != 0.0f || gq[2] != 0.0f;
+					if (hasNormal != hasNormalQ)
+						continue;
+					if (hasNormal)
+					{
+						wN = glm::max(gp[0] * gq[0] + gp[1] * gq[1] + gp[2] * gq[2], 0.0f);
+						for (int k = 0; k < NORMAL_SHARPNESS; k++)
+							wN *= wN;
+					}
+
+					float lumQ = 0.2126f * cq[0] + 0.7152f * cq[1] + 0.0722f * cq[2];
+					float wL = fabsf(lumP - lumQ) * invSigmaL;
+					float wZ = fabsf(gp[3] - gq[3]) * invSigmaZ;
+					float weight = ATROUS_KERNEL[dx + 2] * ATROUS_KERNEL[dy + 2] * wN * expf(-wL - wZ);
+
+					// color is weighted by w, its variance by w^2
+					__m128 wv = _mm_set_ps(weight * weight, weight, weight, weight);
+					acc = _mm_add_ps(acc, _mm_mul_ps(wv, _mm_loadu_ps(cq)));
+					weightSum += weight;
+				}
+			}
+
+			if (weightSum > 0.0f)
+			{
+				float invSum = 1.0f / weightSum;
+				__m128 norm = _mm_set_ps(invSum * invSum, invSum, invSum, invSum);
+				_mm_storeu_ps(out + 4 * p, _mm_mul_ps(acc, norm));
+			}
+			else
+				_mm_storeu_ps(out + 4 * p, _mm_loadu_ps(cp));
+		}
+	}
+}
+
+void Denoiser::Denoise
+(
+	const glm::ivec2& res, const int* samples,
+	const float* colorSum, const float* lumStats,
+	const float* albedoSum, const float* normalSum, const float* depthSum,
+	float* out, int numThreads
+)
+{
+	int numPixels = res.x * res.y;
+	if (mResolution != res || mPing.size() != (size_t)numPixels * 4)
+	{
+		mResolution = res;
+		mPing.assign(numPixels * 4, 0.0f);
+		mPong.assign(numPixels * 4, 0.0f);
+		mGuide.assign(numPixels * 4, 0.0f);
+		mAlbedo.assign(numPixels * 3, 0.0f);
+	}
+
+	// Normalize the sums and demodulate the albedo so only lighting gets blurred
+	#pragma omp parallel for num_threads(numThreads)
+	for (int i = 0; i < numPixels; i++)
+	{
+		float n = (float)samples[i];
+		float invN = n > 0.0f ? 1.0f / n : 0.0f;
+
+		glm::vec3 albedo = glm::vec3(albedoSum[i * 3], albedoSum[i * 3 + 1], albedoSum[i * 3 + 2]) * invN;
+		for (int c = 0; c < 3; c++)
+		{
+			if (albedo[c] < 1e-3f)
+				albedo[c] = 1.0f;
+		}
+		glm::vec3 normal = glm::vec3(normalSum[i * 3], normalSum[i * 3 + 1], normalSum[i * 3 + 2]);
+		if (glm::dot(normal, normal) > 0.0f)
+			normal = glm::normalize(normal);
+
+		float lumMean = lumStats[i * 2] * invN;
+		float lumVar = glm::max(lumStats[i * 2 + 1] * invN - lumMean * lumMean, 0.0f) * invN;
+		float albedoLum = glm::dot(albedo, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+
+		mPing[i * 4] = colorSum[i * 3] * invN / albedo.r;
+		mPing[i * 4 + 1] = colorSum[i * 3 + 1] * invN / albedo.g;
+		mPing[i * 4 + 2] = colorSum[i * 3 + 2] * invN / albedo.b;
+		mPing[i * 4 + 3] = lumVar / (albedoLum * albedoLum);
+
+		mGuide[i * 4] = normal.x;
+		mGuide[i * 4 + 1] = normal.y;
+		mGuide[i * 4 + 2] = normal.z;
+		mGuide[i * 4 + 3] = depthSum[i] * invN;
+
+		mAlbedo[i * 3] = albedo.r;
+		mAlbedo[i * 3 + 1] = albedo.g;
+		mAlbedo[i * 3 + 2] = albedo.b;
+	}
+
+	float* in = &mPing[0];
+	float* filtered = &mPong[0];
+	for (int i = 0; i < mIterations; i++)
+	{
+		FilterPass(in, filtered, 1 << i, numThreads);
+		std::swap(in, filtered);
+	}
+
+	// Remodulate
+	#pragma omp parallel for num_threads(numThreads)
+	for (int i = 0; i < numPixels; i++)
+	{
+		out[i * 3] = in[i * 4] * mAlbedo[i * 3];
+		out[i * 3 + 1] = in[i * 4 + 1] * mAlbedo[i * 3 + 1];
+		out[i * 3 + 2] = in[i * 4 + 2] * mAlbedo[i * 3 + 2];
+	}
+}
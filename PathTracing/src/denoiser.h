@@ -0,0 +1,45 @@
+#ifndef __DENOISER_H__
+#define __DENOISER_H__
+
+#include <vector>
+#include <glm/glm.hpp>
+
+// Edge-avoiding a-trous wavelet filter guided by first-hit albedo, normal and depth.
+// Noise is filtered on the albedo-demodulated irradiance, and the edge-stopping on
+// color is scaled by the per-pixel standard error of the mean, as in SVGF.
+class Denoiser
+{
+private:
+	glm::ivec2 mResolution;
+	// Per pixel: demodulated r, g, b and variance of the mean
+	std::vector<float> mPing;
+	std::vector<float> mPong;
+	// Per pixel: normal x, y, z and depth
+	std::vector<float> mGuide;
+	std::vector<float> mAlbedo;
+
+	int mIterations;
+	float mColorSigma;
+	float mDepthSigma;
+
+public:
+	Denoiser();
+
+private:
+	void FilterPass(const float* in, float* out, int step, int numThreads);
+
+public:
+	const int GetIterations() const;
+	void SetIterations(int iterations);
+
+	// All inputs are per-pixel sums over samples[i] samples, in the PathTracer image layout
+	void Denoise
+	(
+		const glm::ivec2& res, const int* samples,
+		const float* colorSum, const float* lumStats,
+		const float* albedoSum, const float* normalSum, const float* depthSum,
+		float* out, int numThreads
+	);
+};
+
+#endif
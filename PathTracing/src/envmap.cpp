@@ -0,0 +1,153 @@
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <algorithm>
+
+#include <stb_image.h>
+
+#include "envmap.h"
+
+EnvironmentMap::EnvironmentMap() :
+	mWidth(0),
+	mHeight(0)
+{
+	mFilename = "";
+	mData = 0;
+}
+
+EnvironmentMap::EnvironmentMap(const std::string& filename)
+{
+	mFilename = filename;
+	mData = 0;
+	Load(mFilename);
+}
+
+EnvironmentMap::~EnvironmentMap()
+{
+	if (mData)
+		stbi_image_free(mData);
+}
+
+const int EnvironmentMap::width() const
+{
+	return mWidth;
+}
+
+const int EnvironmentMap::height() const
+{
+	return mHeight;
+}
+
+void EnvironmentMap::Load(const std::string& filename)
+{
+	if (mData)
+		stbi_image_free(mData);
+
+	mFilename = filename;
+	int n;
+	// LDR files are converted to linear floats by stb_image
+	mData = stbi_loadf(filename.c_str(), &mWidth, &mHeight, &n, 3);
+	if (!mData)
+	{
+		mWidth = 0;
+		mHeight = 0;
+	}
+
+	BuildDistribution();
+}
+
+void EnvironmentMap::BuildDistribution()
+{
+	std::vector<float>().swap(mMarginalCdf);
+	std::vector<float>().swap(mConditionalCdf);
+	if (!mData)
+		return;
+
+	mMarginalCdf.resize(mHeight);
+	mConditionalCdf.resize(mWidth * mHeight);
+	float marginalSum = 0.0f;
+	for (int y = 0; y < mHeight; y++)
+	{
+		// Rows near the poles cover less solid angle
+		float sinTheta = sinf(M_PI * (y + 0.5f) / mHeight);
+		float* cdf = &mConditionalCdf[y * mWidth];
+		float rowSum = 0.0f;
+		for (int x = 0; x < mWidth; x++)
+		{
+			const float* p = mData + 3 * (y * mWidth + x);
+			rowSum += 0.2126f * p[0] + 0.7152f * p[1] + 0.0722f * p[2];
+			cdf[x] = rowSum;
+		}
+		for (int x = 0; x < mWidth; x++)
+			cdf[x] = rowSum > 0.0f ? cdf[x] / rowSum : (x + 1.0f) / mWidth;
+		cdf[mWidth - 1] = 1.0f;
+
+		marginalSum += rowSum * sinTheta;
+		mMarginalCdf[y] = marginalSum;
+	}
+	for (int y = 0; y < mHeight; y++)
+		mMarginalCdf[y] = marginalSum > 0.0f ? mMarginalCdf[y] / marginalSum : (y + 1.0f) / mHeight;
+	mMarginalCdf[mHeight - 1] = 1.0f;
+}
+
+const glm::ivec2 EnvironmentMap::DirectionToPixel(const glm::vec3& dir) const
+{
+	float u = 0.5f + atan2f(dir.x, dir.z) / (2.0f * M_PI);
+	float v = acosf(glm::clamp(dir.y, -1.0f, 1.0f)) / M_PI;
+	int x = glm::clamp((int)(u * mWidth), 0, mWidth - 1);
+	int y = glm::clamp((int)(v * mHeight), 0, mHeight - 1);
+	return glm::ivec2(x, y);
+}
+
+const glm::vec3 EnvironmentMap::Eval(const glm::vec3& dir) const
+{
+	if (!mData)
+		return glm::vec3(0.0f);
+
+	glm::ivec2 coord = DirectionToPixel(dir);
+	const float* p = mData + 3 * (coord.y * mWidth + coord.x);
+	return glm::vec3(p[0], p[1], p[2]);
+}
+
+const glm::vec3 EnvironmentMap::Sample(float r1, float r2, glm::vec3& dirOut, float& pdfOut) const
+{
+	pdfOut = 0.0f;
+	if (!mData)
+		return glm::vec3(0.0f);
+
+	// Pick a row from the marginal CDF, then a column from that row's conditional CDF
+	int y = std::upper_bound(mMarginalCdf.begin(), mMarginalCdf.end(), r1) - mMarginalCdf.begin();
+	y = glm::min(y, mHeight - 1);
+	float rowCdf = y > 0 ? mMarginalCdf[y - 1] : 0.0f;
+	float rowPdf = mMarginalCdf[y] - rowCdf;
+
+	const float* cdf = &mConditionalCdf[y * mWidth];
+	int x = std::upper_bound(cdf, cdf + mWidth, r2) - cdf;
+	x = glm::min(x, mWidth - 1);
+	float colCdf = x > 0 ? cdf[x - 1] : 0.0f;
+	float colPdf = cdf[x] - colCdf;
+
+	if (rowPdf <= 0.0f || colPdf <= 0.0f)
+		return glm::vec3(0.0f);
+
+	// Reuse the remainder of the random numbers to jitter inside the pixel
+	float u = (x + glm::clamp((r2 - colCdf) / colPdf, 0.0f, 1.0f)) / mWidth;
+	float v = (y + glm::clamp((r1 - rowCdf) / rowPdf, 0.0f, 1.0f)) / mHeight;
+
+	float theta = v * M_PI;
+	float phi = (u - 0.5f) * 2.0f * M_PI;
+	float sinTheta = sinf(theta);
+	if (sinTheta <= 0.0f)
+		return glm::vec3(0.0f);
+	dirOut = glm::vec3(sinTheta * sinf(phi), cosf(theta), sinTheta * cosf(phi));
+
+	// Convert the image space density to solid angle
+	pdfOut = rowPdf * colPdf * mWidth * mHeight / (2.0f * M_PI * M_PI * sinTheta);
+
+	const float* p = mData + 3 * (y * mWidth + x);
+	return glm::vec3(p[0], p[1], p[2]);
+}
+
+float* EnvironmentMap::data()
+{
+	return mData;
+}
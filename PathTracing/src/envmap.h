@@ -0,0 +1,40 @@
+#ifndef __ENVMAP_H__
+#define __ENVMAP_H__
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+// Equirectangular HDR environment light with a marginal/conditional CDF for importance sampling
+class EnvironmentMap
+{
+private:
+	std::string mFilename;
+	int mWidth;
+	int mHeight;
+	float* mData;
+
+	std::vector<float> mMarginalCdf;
+	std::vector<float> mConditionalCdf;
+
+public:
+	EnvironmentMap();
+	EnvironmentMap(const std::string& filename);
+	~EnvironmentMap();
+
+private:
+	void BuildDistribution();
+	const glm::ivec2 DirectionToPixel(const glm::vec3& dir) const;
+
+public:
+	const int width() const;
+	const int height() const;
+
+	void Load(const std::string& filename);
+
+	const glm::vec3 Eval(const glm::vec3& dir) const;
+	const glm::vec3 Sample(float r1, float r2, glm::vec3& dirOut, float& pdfOut) const;
+	float* data();
+};
+
+#endif
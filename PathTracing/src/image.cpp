@@ -1,28 +1,190 @@
+#include <fstream>
+#include <algorithm>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
 #include <stb_image.h>
-#define STB_IMAGE_RESIZE_IMPLEMENTATION
-#include <stb_image_resize.h>
 
 #include "image.h"
+#include "blockcompression.h"
+#include "pathutil.h"
+
+// Textures are stored in tiles of 8 x 8 texels, 256 bytes or four cache lines. Within a
+// tile the texels follow the Morton curve so every aligned 2 x 2 quad is 16 contiguous bytes.
+const int TEXTURE_TILE_BITS = 3;
+// Levels larger than this are paged out in tiles of 64 x 64 texels, 16 KB for RGBA. Their
+// Morton order keeps every 8 x 8 tile within them contiguous as well.
+const int TEXTURE_RESIDENT_SIZE = 1024;
+const int TEXTURE_PAGE_BITS = 6;
+// Spreads the bits of an in-tile coordinate to the even bits of the Morton index
+const int MORTON_SPREAD[1 << TEXTURE_PAGE_BITS] =
+{
+	0, 1, 4, 5, 16, 17, 20, 21, 64, 65, 68, 69, 80, 81, 84, 85,
+	256, 257, 260, 261, 272, 273, 276, 277, 320, 321, 324, 325, 336, 337, 340, 341,
+	1024, 1025, 1028, 1029, 1040, 1041, 1044, 1045, 1088, 1089, 1092, 1093, 1104, 1105, 1108, 1109,
+	1280, 1281, 1284, 1285, 1296, 1297, 1300, 1301, 1344, 1345, 1348, 1349, 1360, 1361, 1364, 1365
+};
+
+// Texture cache files start with the magic, the version changes with the stored layout
+const unsigned int TEXTURE_CACHE_MAGIC = 0x58455450; // "PTEX"
+const unsigned int TEXTURE_CACHE_VERSION = 1;
+// Levels start on page boundaries of the mapping
+const long long TEXTURE_CACHE_ALIGNMENT = 4096;
+// Cache files beyond this size are removed at startup, the least recently mapped ones first
+const long long TEXTURE_CACHE_LIMIT = 16LL << 30;
+// Temporary files this old were left by writes that didn't finish
+const long long TEXTURE_CACHE_TEMP_AGE = 24 * 60 * 60;
+
+struct TextureCacheHeader
+{
+	unsigned int magic;
+	unsigned int version;
+	int format;
+	int blockFormat;
+	int width;
+	int height;
+	int numLevels;
+	int reserved;
+};
+
+struct TextureCacheLevel
+{
+	int width;
+	int height;
+	int tileBits;
+	int tilesX;
+	int tilesY;
+	int tileBytes;
+	long long offset;
+};
+
+static const unsigned long long Fnv1a(const unsigned char* data, size_t size)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static std::string TextureCacheDirectory()
+{
+	return PathUtil::TempDirectory() + "/pathtracing_textures";
+}
+
+// Cache files are named by the source's contents so moved, copied or touched files share one.
+// The version keeps files of an older layout from being picked up.
+static std::string TextureCachePath
+(
+	const std::vector<unsigned char>& source, TextureFormat format, bool compress
+)
+{
+	char name[80];
+	snprintf(name, sizeof(name), "%016llx_%llx_v%u_%d%s.tex", Fnv1a(source.data(), source.size()),
+		(unsigned long long)source.size(), TEXTURE_CACHE_VERSION, (int)format, compress ? "_bc" : "");
+	return TextureCacheDirectory() + "/" + name;
+}
+
+// A reference file named by the source's path and stamp holds the name of its cache file, so
+// loads of unchanged files neither read nor hash the source
+static std::string TextureCacheReference
+(
+	const std::string& filename, long long modifiedTime, long long fileSize, TextureFormat format, bool compress
+)
+{
+	std::string key = PathUtil::CanonicalPath(filename) + "#" + std::to_string(modifiedTime) + "#" +
+		std::to_string(fileSize);
+	char name[80];
+	snprintf(name, sizeof(name), "%016llx_v%u_%d%s.ref", Fnv1a((const unsigned char*)key.data(), key.size()),
+		TEXTURE_CACHE_VERSION, (int)format, compress ? "_bc" : "");
+	return TextureCacheDirectory() + "/" + name;
+}
+
+// Removes cache and reference files of other layout versions, temporary files left behind,
+// the least recently used cache files over the limit and references to missing cache files
+static void CleanTextureCache()
+{
+	struct CacheFile
+	{
+		std::string path;
+		long long modifiedTime;
+		long long size;
+	};
+	std::vector<CacheFile> caches;
+	std::vector<std::string> references;
+	long long totalSize = 0;
+	long long now = (long long)time(0);
+	std::string directory = TextureCacheDirectory();
+	std::string version = "_v" + std::to_string(TEXTURE_CACHE_VERSION) + "_";
+	for (auto& name : PathUtil::ListFiles(directory))
+	{
+		std::string path = directory + "/" + name;
+		std::string extension = name.substr(name.find_last_of('.') + 1);
+		long long modifiedTime = 0, fileSize = 0;
+		if (!PathUtil::GetFileStamp(path, modifiedTime, fileSize))
+			continue;
+		// Another instance may still be writing a recent one
+		if (extension == "tmp")
+		{
+			if (now - modifiedTime > TEXTURE_CACHE_TEMP_AGE)
+				remove(PathUtil::NativePath(path).c_str());
+		}
+		else if (extension != "tex" && extension != "ref")
+			continue;
+		else if (name.find(version) == std::string::npos)
+			remove(PathUtil::NativePath(path).c_str());
+		else if (extension == "tex")
+		{
+			caches.push_back({ path, modifiedTime, fileSize });
+			totalSize += fileSize;
+		}
+		else
+			references.push_back(path);
+	}
+
+	// Files mapped by a running instance stay valid for it
+	std::sort(caches.begin(), caches.end(), [](const CacheFile& a, const CacheFile& b)
+	{
+		return a.modifiedTime < b.modifiedTime;
+	});
+	for (size_t i = 0; i < caches.size() && totalSize > TEXTURE_CACHE_LIMIT; i++)
+	{
+		if (remove(PathUtil::NativePath(caches[i].path).c_str()) == 0)
+			totalSize -= caches[i].size;
+	}
+
+	for (auto& path : references)
+	{
+		std::string cachePath;
+		long long modifiedTime = 0, fileSize = 0;
+		std::ifstream reference(PathUtil::NativePath(path));
+		bool valid = std::getline(reference, cachePath) && PathUtil::GetFileStamp(cachePath, modifiedTime, fileSize);
+		reference.close();
+		if (!valid)
+			remove(PathUtil::NativePath(path).c_str());
+	}
+}
 
 Image::Image() :
 	mWidth(0),
 	mHeight(0)
 {
 	mFilename = "";
-	mData = 0;
+	SetFormat(TextureFormat::RGBA);
 }
 
 Image::Image(const std::string& filename)
 {
 	mFilename = filename;
-	mData = 0;
 	Load(mFilename);
 }
 
 Image::~Image()
 {
-	if (mData)
-		stbi_image_free(mData);
 }
 
 const int Image::width() const
@@ -35,36 +197,425 @@ const int Image::height() const
 	return mHeight;
 }
 
-void Image::Load(const std::string& filename)
+const TextureFormat Image::format() const
+{
+	return mFormat;
+}
+
+const bool Image::paged() const
 {
-	if (mData)
-		stbi_image_free(mData);
+	if (mLevels.empty())
+		return false;
+	const MipLevel& base = mLevels[0];
+	return base.pageOffset >= 0;
+}
+
+void Image::SetFormat(TextureFormat format)
+{
+	mFormat = format;
+	mBlockFormat = BlockFormat::NONE;
+	mBlockBytes = 0;
+	if (format == TextureFormat::R)
+		mChannels = 1;
+	else if (format == TextureFormat::NORMAL_XY)
+		mChannels = 2;
+	else if (format == TextureFormat::ORM)
+		mChannels = 3;
+	else
+		mChannels = 4;
+}
+
+void Image::Load(const std::string& filename, TextureFormat format, bool compress)
+{
+	std::vector<MipLevel>().swap(mLevels);
+	mPageFile.reset();
+	mMapping.reset();
+	SetFormat(format);
 
 	mFilename = filename;
-	int n;
-	mData = stbi_load(filename.c_str(), &mWidth, &mHeight, &n, 4);
+	mWidth = 0;
+	mHeight = 0;
+	long long modifiedTime = 0, fileSize = 0;
+	if (!PathUtil::GetFileStamp(filename, modifiedTime, fileSize))
+		return;
+	compress = compress && format != TextureFormat::ORM;
+	static std::once_flag cleaned;
+	std::call_once(cleaned, CleanTextureCache);
+	std::string referencePath = TextureCacheReference(filename, modifiedTime, fileSize, format, compress);
+	std::string cachePath;
+	std::ifstream reference(PathUtil::NativePath(referencePath));
+	if (std::getline(reference, cachePath) && MapCache(cachePath, format, compress))
+		return;
+	reference.close();
+
+	std::vector<unsigned char> source;
+	std::ifstream file(filename, std::ios::in | std::ios::binary | std::ios::ate);
+	if (!file)
+		return;
+	source.resize((size_t)file.tellg());
+	file.seekg(0);
+	file.read((char*)source.data(), source.size());
+	file.close();
 
-	if (mData && (mWidth > 1024 || mHeight > 1024))
+	cachePath = TextureCachePath(source, format, compress);
+	bool mapped = MapCache(cachePath, format, compress);
+	if (!mapped)
 	{
-		float scale = 1024.f / fmax(mWidth, mHeight);
-		int newWidth = mWidth * scale;
-		int newHeight = mHeight * scale;
-		size_t newSize = newWidth * newHeight * 4 * sizeof(unsigned char);
-		unsigned char* newData = (unsigned char*)malloc(newSize);
-		stbir_resize_uint8(mData, mWidth, mHeight, 0,
-			newData, newWidth, newHeight, 0, 4);
-		stbi_image_free(mData);
-		mWidth = newWidth;
-		mHeight = newHeight;
-		mData = newData;
+		int n;
+		unsigned char* data = stbi_load_from_memory(source.data(), (int)source.size(), &mWidth, &mHeight, &n, 4);
+		std::vector<unsigned char>().swap(source);
+		if (!data)
+		{
+			mWidth = 0;
+			mHeight = 0;
+			return;
+		}
+		BuildLevels(data, compress);
+		stbi_image_free(data);
+
+		// This load switches to the mapping too, dropping its own copy of the texels
+		mapped = WriteCache(cachePath) && MapCache(cachePath, format, compress);
+	}
+	if (mapped)
+	{
+		std::ofstream out(PathUtil::NativePath(referencePath), std::ios::out | std::ios::trunc);
+		out << cachePath << "\n";
 	}
 }
 
-glm::vec4 Image::tex2D(const glm::vec2& uv)
+void Image::BuildLevels(unsigned char* data, bool compress)
 {
-	if (!mData)
-		return glm::vec4(0.0f);
+	// Reduce the texels to the stored channels in place
+	size_t numTexels = (size_t)mWidth * mHeight;
+	for (size_t i = 0; i < numTexels; i++)
+	{
+		const unsigned char* src = data + i * 4;
+		unsigned char* dst = data + i * mChannels;
+		if (mFormat == TextureFormat::R)
+			dst[0] = src[0];
+		else if (mFormat == TextureFormat::NORMAL_XY)
+		{
+			glm::vec3 n = glm::vec3(src[0], src[1], src[2]) / 255.0f * 2.0f - 1.0f;
+			if (n.z <= 0.0f)
+				n.z = 0.00001f;
+			n = glm::normalize(n);
+			dst[0] = (unsigned char)((n.x * 0.5f + 0.5f) * 255.0f + 0.5f);
+			dst[1] = (unsigned char)((n.y * 0.5f + 0.5f) * 255.0f + 0.5f);
+		}
+	}
+
+	SetBaseLevel(data, mWidth, mHeight);
+	if (compress)
+		ChooseBlockFormat();
+	BuildMips();
+}
+
+void Image::Pack(Image* opacity, Image* roughness, Image* metallic)
+{
+	std::vector<MipLevel>().swap(mLevels);
+	mPageFile.reset();
+	mMapping.reset();
+	SetFormat(TextureFormat::ORM);
+
+	Image* maps[3] = { opacity, roughness, metallic };
+	mFilename = "";
+	mWidth = 0;
+	mHeight = 0;
+	for (auto map : maps)
+	{
+		if (!map)
+			continue;
+		mFilename += (mFilename.size() ? "|" : "") + map->mFilename;
+		mWidth = glm::max(mWidth, map->width());
+		mHeight = glm::max(mHeight, map->height());
+	}
+	if (mWidth == 0 || mHeight == 0)
+		return;
+
+	std::vector<unsigned char> texels(mWidth * mHeight * 3, 0);
+	for (int y = 0; y < mHeight; y++)
+	{
+		for (int x = 0; x < mWidth; x++)
+		{
+			// Maps of the packed size are copied exactly, smaller ones are upsampled
+			glm::vec2 uv = glm::vec2(((float)x + 0.5f) / mWidth, ((float)y + 0.5f) / mHeight);
+			for (int k = 0; k < 3; k++)
+			{
+				if (maps[k])
+					texels[(y * mWidth + x) * 3 + k] = (unsigned char)(maps[k]->tex2D(uv).r * 255.0f + 0.5f);
+			}
+		}
+	}
+
+	SetBaseLevel(texels.data(), mWidth, mHeight);
+	BuildMips();
+}
+
+const size_t Image::MipLevel::Offset(int x, int y) const
+{
+	int mask = (1 << tileBits) - 1;
+	size_t tile = (size_t)(y >> tileBits) * tilesX + (x >> tileBits);
+	int texel = MORTON_SPREAD[x & mask] | (MORTON_SPREAD[y & mask] << 1);
+	return ((tile << (2 * tileBits)) | texel) * channels;
+}
+
+const size_t Image::MipLevel::BlockOffset(int bx, int by, int blockBytes) const
+{
+	int bits = tileBits - 2;
+	int mask = (1 << bits) - 1;
+	size_t tile = (size_t)(by >> bits) * tilesX + (bx >> bits);
+	int block = ((by & mask) << bits) | (bx & mask);
+	return ((tile << (2 * bits)) | block) * blockBytes;
+}
+
+const unsigned char* Image::MipLevel::Bytes() const
+{
+	return mapped ? mapped : data.data();
+}
+
+const size_t Image::MipLevel::Size() const
+{
+	return (size_t)tilesX * tilesY * tileBytes;
+}
+
+void Image::InitLevel(MipLevel& level, int width, int height)
+{
+	level.width = width;
+	level.height = height;
+	level.channels = mChannels;
+	level.tileBits = glm::max(width, height) > TEXTURE_RESIDENT_SIZE ? TEXTURE_PAGE_BITS : TEXTURE_TILE_BITS;
+	int tileSize = 1 << level.tileBits;
+	level.tilesX = (width + tileSize - 1) >> level.tileBits;
+	level.tilesY = (height + tileSize - 1) >> level.tileBits;
+	level.tileBytes = tileSize * tileSize * mChannels;
+	level.data.resize(level.Size());
+	level.mapped = 0;
+	level.pageOffset = -1;
+}
+
+void Image::SetBaseLevel(const unsigned char* texels, int width, int height)
+{
+	MipLevel level;
+	InitLevel(level, width, height);
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			const unsigned char* src = texels + ((size_t)y * width + x) * mChannels;
+			unsigned char* dst = &level.data[level.Offset(x, y)];
+			for (int k = 0; k < mChannels; k++)
+				dst[k] = src[k];
+		}
+	}
+	mLevels.push_back(std::move(level));
+}
+
+void Image::BuildMips()
+{
+	while (mLevels.back().width > 1 || mLevels.back().height > 1)
+	{
+		MipLevel& src = mLevels.back();
+		MipLevel level;
+		InitLevel(level, glm::max(src.width / 2, 1), glm::max(src.height / 2, 1));
+		for (int y = 0; y < level.height; y++)
+		{
+			int y0 = glm::min(y * 2, src.height - 1);
+			int y1 = glm::min(y * 2 + 1, src.height - 1);
+			for (int x = 0; x < level.width; x++)
+			{
+				int x0 = glm::min(x * 2, src.width - 1);
+				int x1 = glm::min(x * 2 + 1, src.width - 1);
+				const unsigned char* p00 = &src.data[src.Offset(x0, y0)];
+				const unsigned char* p01 = &src.data[src.Offset(x1, y0)];
+				const unsigned char* p10 = &src.data[src.Offset(x0, y1)];
+				const unsigned char* p11 = &src.data[src.Offset(x1, y1)];
+				unsigned char* dst = &level.data[level.Offset(x, y)];
+				for (int k = 0; k < mChannels; k++)
+					dst[k] = (unsigned char)((p00[k] + p01[k] + p10[k] + p11[k] + 2) / 4);
+			}
+		}
+		// A level is final once the next one is filtered from it
+		FinishLevel(src);
+		mLevels.push_back(std::move(level));
+	}
+	FinishLevel(mLevels.back());
+}
 
+void Image::FinishLevel(MipLevel& level)
+{
+	if (mBlockFormat != BlockFormat::NONE)
+		CompressLevel(level);
+	if (glm::max(level.width, level.height) <= TEXTURE_RESIDENT_SIZE)
+		return;
+
+	if (!mPageFile)
+		mPageFile = std::make_shared<TileCache::PageFile>();
+	// Kept in memory if the page file can't be written
+	long long offset = mPageFile->Append(level.data.data(), level.Size());
+	if (offset < 0)
+		return;
+	level.pageOffset = offset;
+	std::vector<unsigned char>().swap(level.data);
+}
+
+TileCache::TileSource* Image::TileSourceOf(const MipLevel& level) const
+{
+	if (level.mapped)
+		return mMapping.get();
+	return mPageFile.get();
+}
+
+void Image::ChooseBlockFormat()
+{
+	const MipLevel& base = mLevels[0];
+	if (mFormat == TextureFormat::R)
+		mBlockFormat = BlockFormat::BC4;
+	else if (mFormat == TextureFormat::NORMAL_XY)
+		mBlockFormat = BlockFormat::BC5;
+	else
+	{
+		// Only spend the alpha block on images that use it
+		mBlockFormat = BlockFormat::BC1;
+		for (int y = 0; y < mHeight && mBlockFormat == BlockFormat::BC1; y++)
+		{
+			for (int x = 0; x < mWidth; x++)
+			{
+				if (base.data[base.Offset(x, y) + 3] != 255)
+				{
+					mBlockFormat = BlockFormat::BC3;
+					break;
+				}
+			}
+		}
+	}
+	SetBlockFormat(mBlockFormat);
+}
+
+void Image::SetBlockFormat(BlockFormat format)
+{
+	mBlockFormat = format;
+	if (format == BlockFormat::BC1)
+		mBlockBytes = BlockCompression::BC1_BLOCK_BYTES;
+	else if (format == BlockFormat::BC3)
+		mBlockBytes = BlockCompression::BC3_BLOCK_BYTES;
+	else if (format == BlockFormat::BC4)
+		mBlockBytes = BlockCompression::BC4_BLOCK_BYTES;
+	else if (format == BlockFormat::BC5)
+		mBlockBytes = BlockCompression::BC5_BLOCK_BYTES;
+	else
+		mBlockBytes = 0;
+}
+
+void Image::CompressLevel(MipLevel& level)
+{
+	int tileBlocks = 1 << (level.tileBits - 2);
+	int blocksX = (level.width + 3) / 4;
+	int blocksY = (level.height + 3) / 4;
+	int tileBytes = tileBlocks * tileBlocks * mBlockBytes;
+	std::vector<unsigned char> blocks((size_t)level.tilesX * level.tilesY * tileBytes);
+	unsigned char texels[16 * 4];
+	for (int by = 0; by < blocksY; by++)
+	{
+		for (int bx = 0; bx < blocksX; bx++)
+		{
+			// Blocks over the edge repeat the last row and column
+			for (int i = 0; i < 16; i++)
+			{
+				int x = glm::min(bx * 4 + (i & 3), level.width - 1);
+				int y = glm::min(by * 4 + (i >> 2), level.height - 1);
+				const unsigned char* src = &level.data[level.Offset(x, y)];
+				for (int k = 0; k < mChannels; k++)
+					texels[i * 4 + k] = src[k];
+			}
+			unsigned char* block = &blocks[level.BlockOffset(bx, by, mBlockBytes)];
+			if (mBlockFormat == BlockFormat::BC1)
+				BlockCompression::EncodeBC1(texels, block);
+			else if (mBlockFormat == BlockFormat::BC3)
+				BlockCompression::EncodeBC3(texels, block);
+			else if (mBlockFormat == BlockFormat::BC4)
+				BlockCompression::EncodeBC4(texels, 4, block);
+			else
+				BlockCompression::EncodeBC5(texels, 4, block);
+		}
+	}
+	level.data.swap(blocks);
+	level.tileBytes = tileBytes;
+}
+
+void Image::Texels
+(
+	const MipLevel& level, const size_t* offsets, int count, int size,
+	unsigned char* scratch, const unsigned char** texels
+) const
+{
+	if (level.pageOffset < 0)
+	{
+		const unsigned char* bytes = level.Bytes();
+		for (int i = 0; i < count; i++)
+			texels[i] = bytes + offsets[i];
+		return;
+	}
+
+	// Runs in the same tile are read together, taking the cache's lock once
+	for (int i = 0; i < count;)
+	{
+		size_t tile = offsets[i] / level.tileBytes;
+		int tileOffsets[4];
+		int n = 0;
+		while (i + n < count && n < 4 && offsets[i + n] / level.tileBytes == tile)
+		{
+			tileOffsets[n] = (int)(offsets[i + n] - tile * level.tileBytes);
+			texels[i + n] = scratch + (i + n) * size;
+			n++;
+		}
+		TileCache::Read(TileSourceOf(level), level.pageOffset + (long long)tile * level.tileBytes, level.tileBytes,
+			tileOffsets, n, size, scratch + i * size);
+		i += n;
+	}
+}
+
+void Image::Decode(const MipLevel& level, const int* x, const int* y, int count, unsigned char* texels) const
+{
+	// A bilinear footprint mostly falls in one block, its palette is then built once
+	int bx = x[0] >> 2;
+	int by = y[0] >> 2;
+	bool sameBlock = true;
+	int indices[4];
+	size_t offsets[4];
+	for (int i = 0; i < count; i++)
+	{
+		sameBlock = sameBlock && (x[i] >> 2) == bx && (y[i] >> 2) == by;
+		indices[i] = ((y[i] & 3) << 2) | (x[i] & 3);
+		offsets[i] = level.BlockOffset(x[i] >> 2, y[i] >> 2, mBlockBytes);
+	}
+	unsigned char scratch[4 * BlockCompression::BC3_BLOCK_BYTES];
+	const unsigned char* blocks[4];
+	if (sameBlock)
+	{
+		Texels(level, offsets, 1, mBlockBytes, scratch, blocks);
+		DecodeBlock(blocks[0], indices, count, texels);
+		return;
+	}
+
+	Texels(level, offsets, count, mBlockBytes, scratch, blocks);
+	for (int i = 0; i < count; i++)
+		DecodeBlock(blocks[i], indices + i, 1, texels + i * 4);
+}
+
+void Image::DecodeBlock(const unsigned char* block, const int* indices, int count, unsigned char* texels) const
+{
+	if (mBlockFormat == BlockFormat::BC1)
+		BlockCompression::DecodeBC1(block, indices, count, texels);
+	else if (mBlockFormat == BlockFormat::BC3)
+		BlockCompression::DecodeBC3(block, indices, count, texels);
+	else if (mBlockFormat == BlockFormat::BC4)
+		BlockCompression::DecodeBC4(block, indices, count, texels);
+	else
+		BlockCompression::DecodeBC5(block, indices, count, texels);
+}
+
+const glm::vec4 Image::Bilinear(const MipLevel& level, const glm::vec2& uv) const
+{
 	float u = fmod(uv.x, 1.0f);
 	float v = fmod(uv.y, 1.0f);
 
@@ -73,19 +624,249 @@ glm::vec4 Image::tex2D(const glm::vec2& uv)
 	if (v < 0.0f)
 		v += 1.0f;
 
-	glm::ivec2 coord = glm::ivec2(mWidth * u, mHeight * v);
-	const unsigned char* p = mData + (4 * (coord.y * mWidth + coord.x));
+	// Texel centers sit at half integer coordinates, neighbours wrap around
+	float x = u * level.width - 0.5f;
+	float y = v * level.height - 0.5f;
+	int x0 = (int)floorf(x);
+	int y0 = (int)floorf(y);
+	float fx = x - (float)x0;
+	float fy = y - (float)y0;
+	x0 = (x0 + level.width) % level.width;
+	y0 = (y0 + level.height) % level.height;
+	int x1 = (x0 + 1) % level.width;
+	int y1 = (y0 + 1) % level.height;
 
-	float r = (float)p[0] / 255.0f;
-	float g = (float)p[1] / 255.0f;
-	float b = (float)p[2] / 255.0f;
-	float a = (float)p[3] / 255.0f;
+	const unsigned char* p[4];
+	unsigned char texels[4 * 4];
+	if (mBlockFormat == BlockFormat::NONE)
+	{
+		const size_t offsets[4] = { level.Offset(x0, y0), level.Offset(x1, y0), level.Offset(x0, y1), level.Offset(x1, y1) };
+		Texels(level, offsets, 4, level.channels, texels, p);
+	}
+	else
+	{
+		const int xs[4] = { x0, x1, x0, x1 };
+		const int ys[4] = { y0, y0, y1, y1 };
+		Decode(level, xs, ys, 4, texels);
+		for (int i = 0; i < 4; i++)
+			p[i] = texels + i * 4;
+	}
 
-	glm::vec4 res = glm::vec4(r, g, b, a);
+	glm::vec4 res = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+	for (int k = 0; k < level.channels; k++)
+	{
+		float top = (float)p[0][k] + ((float)p[1][k] - (float)p[0][k]) * fx;
+		float bottom = (float)p[2][k] + ((float)p[3][k] - (float)p[2][k]) * fx;
+		res[k] = (top + (bottom - top) * fy) / 255.0f;
+	}
+	if (level.channels == 1)
+		res = glm::vec4(res.r, res.r, res.r, 1.0f);
 	return res;
 }
 
+const Image::MipLevel& Image::Level(float lod) const
+{
+	// Also catches NaN footprints
+	int maxLevel = mLevels.size() - 1;
+	int level = lod > 0.0f ? (int)(glm::min(lod, (float)maxLevel) + 0.5f) : 0;
+	return mLevels[level];
+}
+
+glm::vec4 Image::tex2D(const glm::vec2& uv, float lod)
+{
+	if (mLevels.empty())
+		return glm::vec4(0.0f);
+	return Bilinear(Level(lod), uv);
+}
+
+glm::vec3 Image::normal2D(const glm::vec2& uv, float lod)
+{
+	if (mLevels.empty())
+		return glm::vec3(0.0f, 0.0f, 1.0f);
+	glm::vec4 xy = Bilinear(Level(lod), uv) * 2.0f - 1.0f;
+	return glm::vec3(xy.x, xy.y, sqrtf(glm::max(1.0f - xy.x * xy.x - xy.y * xy.y, 0.0f)));
+}
+
+const Image::MipLevel* Image::ResidentLevel() const
+{
+	for (auto& level : mLevels)
+	{
+		if (level.pageOffset < 0 && glm::max(level.width, level.height) <= TEXTURE_RESIDENT_SIZE)
+			return &level;
+	}
+	return 0;
+}
+
 unsigned char* Image::data()
 {
-	return mData;
+	const MipLevel* level = ResidentLevel();
+	if (!level)
+		return 0;
+	return (unsigned char*)level->Bytes();
+}
+
+std::vector<unsigned char> Image::rows(int& width, int& height) const
+{
+	std::vector<unsigned char> res;
+	const MipLevel* level = ResidentLevel();
+	width = level ? level->width : 0;
+	height = level ? level->height : 0;
+	if (!level)
+		return res;
+
+	res.resize(width * height * 4);
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			unsigned char texel[4];
+			const unsigned char* src = texel;
+			if (mBlockFormat == BlockFormat::NONE)
+				src = level->Bytes() + level->Offset(x, y);
+			else
+				Decode(*level, &x, &y, 1, texel);
+			unsigned char* dst = &res[(y * width + x) * 4];
+			dst[0] = src[0];
+			dst[1] = mChannels > 1 ? src[1] : src[0];
+			dst[2] = mChannels > 2 ? src[2] : (mChannels == 1 ? src[0] : 0);
+			dst[3] = mChannels > 3 ? src[3] : 255;
+			if (mFormat == TextureFormat::NORMAL_XY)
+			{
+				glm::vec2 n = glm::vec2(src[0], src[1]) / 255.0f * 2.0f - 1.0f;
+				float z = sqrtf(glm::max(1.0f - n.x * n.x - n.y * n.y, 0.0f));
+				dst[2] = (unsigned char)((z * 0.5f + 0.5f) * 255.0f + 0.5f);
+			}
+		}
+	}
+	return res;
+}
+
+const bool Image::MapCache(const std::string& path, TextureFormat format, bool compress)
+{
+	// Orders the files for CleanTextureCache, before the mapping holds the file open
+	PathUtil::TouchFile(path);
+	std::shared_ptr<MappedFile> mapping = std::make_shared<MappedFile>(path);
+	const unsigned char* bytes = mapping->data();
+	TextureCacheHeader header;
+	if (!bytes || mapping->size() < sizeof(header))
+		return false;
+	memcpy(&header, bytes, sizeof(header));
+	if (header.magic != TEXTURE_CACHE_MAGIC || header.version != TEXTURE_CACHE_VERSION ||
+		header.format != (int)format || (header.blockFormat != (int)BlockFormat::NONE) != compress ||
+		header.blockFormat < (int)BlockFormat::NONE || header.blockFormat > (int)BlockFormat::BC5 ||
+		header.numLevels <= 0 || header.numLevels > 32 ||
+		mapping->size() < sizeof(header) + header.numLevels * sizeof(TextureCacheLevel))
+		return false;
+
+	// Nothing in the file is trusted that could index out of it
+	SetFormat(format);
+	SetBlockFormat((BlockFormat)header.blockFormat);
+	std::vector<MipLevel> levels(header.numLevels);
+	for (int i = 0; i < header.numLevels; i++)
+	{
+		TextureCacheLevel entry;
+		memcpy(&entry, bytes + sizeof(header) + i * sizeof(entry), sizeof(entry));
+		MipLevel& level = levels[i];
+		level.width = entry.width;
+		level.height = entry.height;
+		level.channels = mChannels;
+		level.tileBits = entry.tileBits;
+		level.tilesX = entry.tilesX;
+		level.tilesY = entry.tilesY;
+		level.tileBytes = entry.tileBytes;
+		level.mapped = bytes + entry.offset;
+		// Large levels go through the TileCache so their texels count against its budget
+		level.pageOffset = glm::max(entry.width, entry.height) > TEXTURE_RESIDENT_SIZE ? entry.offset : -1;
+
+		bool valid = (entry.tileBits == TEXTURE_TILE_BITS || entry.tileBits == TEXTURE_PAGE_BITS) &&
+			entry.width > 0 && entry.height > 0 &&
+			entry.tilesX == (entry.width + (1 << entry.tileBits) - 1) >> entry.tileBits &&
+			entry.tilesY == (entry.height + (1 << entry.tileBits) - 1) >> entry.tileBits;
+		int tileTexels = 1 << (2 * entry.tileBits);
+		valid = valid && entry.tileBytes == (mBlockBytes ? tileTexels / 16 * mBlockBytes : tileTexels * mChannels);
+		valid = valid && entry.offset >= 0 && entry.offset + (long long)level.Size() <= (long long)mapping->size();
+		if (!valid)
+		{
+			SetFormat(format);
+			return false;
+		}
+	}
+
+	mLevels.swap(levels);
+	mWidth = mLevels[0].width;
+	mHeight = mLevels[0].height;
+	mPageFile.reset();
+	mMapping = std::make_shared<TileCache::MappedTiles>(mapping);
+	return true;
+}
+
+const bool Image::WriteCache(const std::string& path) const
+{
+	std::string directory = path.substr(0, path.find_last_of('/'));
+	if (!PathUtil::MakeDirectory(directory))
+		return false;
+
+	TextureCacheHeader header;
+	header.magic = TEXTURE_CACHE_MAGIC;
+	header.version = TEXTURE_CACHE_VERSION;
+	header.format = (int)mFormat;
+	header.blockFormat = (int)mBlockFormat;
+	header.width = mWidth;
+	header.height = mHeight;
+	header.numLevels = (int)mLevels.size();
+	header.reserved = 0;
+
+	std::vector<TextureCacheLevel> entries(mLevels.size());
+	long long offset = sizeof(header) + entries.size() * sizeof(TextureCacheLevel);
+	for (size_t i = 0; i < mLevels.size(); i++)
+	{
+		const MipLevel& level = mLevels[i];
+		TextureCacheLevel& entry = entries[i];
+		entry.width = level.width;
+		entry.height = level.height;
+		entry.tileBits = level.tileBits;
+		entry.tilesX = level.tilesX;
+		entry.tilesY = level.tilesY;
+		entry.tileBytes = level.tileBytes;
+		entry.offset = (offset + TEXTURE_CACHE_ALIGNMENT - 1) / TEXTURE_CACHE_ALIGNMENT * TEXTURE_CACHE_ALIGNMENT;
+		offset = entry.offset + level.Size();
+	}
+
+	// Written aside and renamed so nobody maps a partial file
+	std::string tempPath = path + "." + PathUtil::UniqueName() + ".tmp";
+	std::ofstream file(PathUtil::NativePath(tempPath), std::ios::out | std::ios::binary | std::ios::trunc);
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)entries.data(), entries.size() * sizeof(TextureCacheLevel));
+	std::vector<unsigned char> tile;
+	for (size_t i = 0; i < mLevels.size() && file; i++)
+	{
+		const MipLevel& level = mLevels[i];
+		std::vector<char> padding((size_t)(entries[i].offset - file.tellp()), 0);
+		file.write(padding.data(), padding.size());
+		if (level.pageOffset < 0)
+		{
+			file.write((const char*)level.Bytes(), level.Size());
+			continue;
+		}
+		// Paged levels are copied a tile at a time past the tile cache
+		tile.resize(level.tileBytes);
+		for (int t = 0; t < level.tilesX * level.tilesY && file; t++)
+		{
+			if (!TileSourceOf(level)->Read(level.pageOffset + (long long)t * level.tileBytes, tile.data(), tile.size()))
+				file.setstate(std::ios::failbit);
+			file.write((const char*)tile.data(), tile.size());
+		}
+	}
+	bool written = (bool)file;
+	file.close();
+
+	// A stale file of an older version is replaced
+	if (written && !file.fail())
+	{
+		remove(PathUtil::NativePath(path).c_str());
+		if (rename(PathUtil::NativePath(tempPath).c_str(), PathUtil::NativePath(path).c_str()) == 0)
+			return true;
+	}
+	remove(PathUtil::NativePath(tempPath).c_str());
+	return false;
 }
@@ -2,15 +2,109 @@
 #define __IMAGE_H__
 
 #include <string>
+#include <vector>
+#include <memory>
 #include <glm/glm.hpp>
 
+#include "tilecache.h"
+#include "mappedfile.h"
+
+// How the texels of an image are stored
+enum class TextureFormat
+{
+	RGBA,
+	// Scalar maps keep the red channel only
+	R,
+	// Unit tangent space normals keep x and y, z is rebuilt on fetch
+	NORMAL_XY,
+	// Opacity, roughness and metallic maps packed into one image by Image::Pack
+	ORM
+};
+
 class Image
 {
 private:
 	std::string mFilename;
 	int mWidth;
 	int mHeight;
-	unsigned char* mData;
+	TextureFormat mFormat;
+	int mChannels;
+
+	// Block compressed storage picked from the format, see ChooseBlockFormat
+	enum class BlockFormat
+	{
+		NONE,
+		BC1,
+		BC3,
+		BC4,
+		BC5
+	};
+	BlockFormat mBlockFormat;
+	int mBlockBytes;
+
+	struct MipLevel
+	{
+		int width;
+		int height;
+		int channels;
+		// Texels per tile side as a power of two
+		int tileBits;
+		int tilesX;
+		int tilesY;
+		int tileBytes;
+		// 8 bit channels in square tiles stored row by row, the texels of a tile in Morton order.
+		// Block compressed levels store the 4 x 4 blocks of a tile row by row instead. Empty
+		// while the level is paged out or mapped.
+		std::vector<unsigned char> data;
+		// The level in a mapped texture cache file, null if it isn't mapped
+		const unsigned char* mapped;
+		// Start of the tiles in the page file or the mapped file, -1 if the level is in memory or
+		// small enough to be read from the mapping directly
+		long long pageOffset;
+
+		// Byte offsets in the level, levels may exceed 2 GB
+		const size_t Offset(int x, int y) const;
+		const size_t BlockOffset(int bx, int by, int blockBytes) const;
+		// Mapped or owned texels, not valid while paged
+		const unsigned char* Bytes() const;
+		const size_t Size() const;
+	};
+	// The base image followed by box filtered levels, each half the size of the previous one
+	std::vector<MipLevel> mLevels;
+	// Holds the levels too large to keep in memory, null if there are none
+	std::shared_ptr<TileCache::PageFile> mPageFile;
+	// The texture cache file all levels are mapped from, null if it couldn't be used
+	std::shared_ptr<TileCache::MappedTiles> mMapping;
+
+	void SetFormat(TextureFormat format);
+	// Builds the levels from decoded RGBA8 texels, reduced to the stored channels in place
+	void BuildLevels(unsigned char* data, bool compress);
+	void InitLevel(MipLevel& level, int width, int height);
+	void SetBaseLevel(const unsigned char* texels, int width, int height);
+	void BuildMips();
+	// Compresses and pages out a level as needed
+	void FinishLevel(MipLevel& level);
+	void ChooseBlockFormat();
+	void SetBlockFormat(BlockFormat format);
+	void CompressLevel(MipLevel& level);
+	// The page file or mapping a paged level is read from
+	TileCache::TileSource* TileSourceOf(const MipLevel& level) const;
+	// Pointers to count runs of size bytes at offsets in the level, copied to scratch if it
+	// is paged out
+	void Texels
+	(
+		const MipLevel& level, const size_t* offsets, int count, int size,
+		unsigned char* scratch, const unsigned char** texels
+	) const;
+	// Up to 4 texels of a block compressed level to 4 bytes each
+	void Decode(const MipLevel& level, const int* x, const int* y, int count, unsigned char* texels) const;
+	void DecodeBlock(const unsigned char* block, const int* indices, int count, unsigned char* texels) const;
+	const glm::vec4 Bilinear(const MipLevel& level, const glm::vec2& uv) const;
+	const MipLevel& Level(float lod) const;
+	const MipLevel* ResidentLevel() const;
+	// Converted levels are stored in a cache file per source file, format and compression
+	const bool MapCache(const std::string& path, TextureFormat format, bool compress);
+	const bool WriteCache(const std::string& path) const;
 
 public:
 	Image();
@@ -20,11 +114,29 @@ public:
 public:
 	const int width() const;
 	const int height() const;
+	const TextureFormat format() const;
+	// Whether the base level is read through the TileCache
+	const bool paged() const;
 
-	void Load(const std::string& filename);
+	// Images are kept at full resolution. A file is converted once to a cache file holding its
+	// levels in the stored layout, later loads map that file. Levels over 1024 texels are read
+	// through the TileCache, from the mapping or, without a cache file, from a temporary file
+	// they are paged out to. Compressed images take an eighth (opaque RGBA)
+	// to half (R, NORMAL_XY) of the memory, packed ORM images aren't compressed as their
+	// channels are unrelated.
+	void Load(const std::string& filename, TextureFormat format = TextureFormat::RGBA, bool compress = false);
+	// Packs the red channels of the maps at the size of the largest one, any may be null
+	void Pack(Image* opacity, Image* roughness, Image* metallic);
 
-	glm::vec4 tex2D(const glm::vec2& uv);
+	// Bilinear fetch from the MIP level nearest to lod, 0 being the base image. Single
+	// channel images return their value in rgb, missing channels are 0 and alpha is 1.
+	glm::vec4 tex2D(const glm::vec2& uv, float lod = 0.0f);
+	// Tangent space normal of a NORMAL_XY image, not normalized after filtering
+	glm::vec3 normal2D(const glm::vec2& uv, float lod = 0.0f);
+	// Largest level of at most 1024 texels in the stored layout, null if nothing is loaded
 	unsigned char* data();
+	// Largest level of at most 1024 texels as plain RGBA8 rows, e.g. for uploading
+	std::vector<unsigned char> rows(int& width, int& height) const;
 };
 
 #endif
@@ -2,13 +2,16 @@
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
-#define TINYOBJLOADER_IMPLEMENTATION
 
 #include <string>
 #include <vector>
 #include <fstream>
 #include <sstream>
 #include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 
 #include <math.h>
 
@@ -40,6 +43,8 @@
 #include "pathtracer.h"
 #include "previewer.h"
 #include "pathutil.h"
+#include "texturecache.h"
+#include "tilecache.h"
 
 /* ----- GLFW/IMGUI PARAMS ------ */
 GLFWwindow* window;
@@ -64,7 +69,6 @@ GLuint rbo = -1;
 GLuint frameTex = -1;
 GLuint fboTex = -1;
 GLuint pickTex = -1;
-GLubyte* texData = 0;
 
 ImFont* bigIconFont = 0;
 ImFont* normalIconFont = 0;
@@ -76,6 +80,24 @@ const std::string minFileVersion = "2.0.0";
 
 PathTracer pathTracer;
 int traceDepth = 3;
+int rouletteDepth = 3;
+bool adaptiveSampling = false;
+float adaptiveThreshold = 0.01f;
+bool denoise = false;
+bool denoiseExport = true;
+bool exportAovs = false;
+int tonemapOperator = (int)TonemapOperator::CLAMP;
+bool srgbOutput = false;
+bool lightGroups = false;
+bool packMaterialMaps = false;
+bool compressTextures = false;
+int textureBudget = 1024; // in megabytes
+int renderThreads = 0;
+int reservedThreads = 3;
+int samplesPerPass = 1;
+float navigationFrameTime = 33.0f; // in millisecond
+std::string envMapFile = "";
+float envIntensity = 1.0f;
 
 bool autoRes = false;
 bool resChanged = true;
@@ -83,12 +105,46 @@ bool resChanged = true;
 int targetSample = 0;
 bool showProgressBar = false;
 
-bool render = false;
-bool restart = false;
-bool pause = false;
-bool isPausing = false;
-bool stop = false;
-bool init = true;
+// Render state, shared by the UI and the path tracer thread
+std::atomic<bool> render(false);
+std::atomic<bool> restart(false);
+std::atomic<bool> pause(false);
+std::atomic<bool> isPausing(false);
+std::atomic<bool> stop(false);
+std::atomic<bool> init(true);
+// Longest stretch the path tracer thread renders before it looks at the render state again
+const int renderSliceMillis = 100;
+
+// The path tracer thread sleeps on renderWake until the UI sends a command
+std::mutex renderMutex;
+std::condition_variable renderWake;
+bool renderCommand = false;
+std::chrono::steady_clock::time_point renderCommandTime;
+std::atomic<float> wakeLatency(0.0f); // in millisecond
+
+// Camera navigation on the path tracer output
+std::atomic<bool> navigating(false);
+// Camera changes made while the path tracer runs, handed to its thread under renderMutex
+bool cameraPending = false;
+glm::vec3 pendingCamPos;
+glm::vec3 pendingCamDir;
+glm::vec3 pendingCamUp;
+float pendingCamFocal = 0.0f;
+float pendingCamFovy = 0.0f;
+float pendingCamFocalDist = 0.0f;
+float pendingCamF = 0.0f;
+
+// What a restart has to send to the path tracer again, guarded by renderMutex
+enum class SceneChange
+{
+	NONE,
+	CAMERA,
+	MATERIAL,
+	SCENE
+};
+SceneChange sceneChange = SceneChange::NONE;
+// Material and texture edits made on a loaded scene, replayed on the path tracer thread
+std::vector<std::function<void()>> pendingMaterialEdits;
 
 bool canLoad = true;
 bool canStart = true;
@@ -96,8 +152,8 @@ bool canPause = false;
 bool canStop = false;
 bool canRestart = false;
 
-bool saveFile = false;
-bool exportFile = false;
+std::atomic<bool> saveFile(false);
+std::atomic<bool> exportFile(false);
 std::string exportFilePath = "";
 std::string sceneFilePath = "";
 
@@ -109,7 +165,7 @@ bool saveAndOpen = false;
 bool saveAndLoad = false;
 bool saveAndExit = false;
 std::string pendingLoadSceneFile = "";
-bool execAfterSave = false;
+std::atomic<bool> execAfterSave(false);
 
 std::string statusText = "";
 std::chrono::steady_clock::time_point statusShowBegin;
@@ -165,14 +221,65 @@ bool needsRedirObjects = false;
 /* ----- PATHTRACER/PREVIEWER PARAMS ------ */
 
 /* ----- TOOL FUNCTIONS ------ */
+void WakePathTracer()
+{
+	{
+		std::lock_guard<std::mutex> lock(renderMutex);
+		if (!renderCommand)
+			renderCommandTime = std::chrono::steady_clock::now();
+		renderCommand = true;
+	}
+	renderWake.notify_one();
+}
+
+// Copies the previewer camera to the pending one, renderMutex must be held. Returns false if
+// it did not change.
+bool SyncPendingCamera()
+{
+	if (previewer.CameraPosition() == pendingCamPos && previewer.CameraDirection() == pendingCamDir &&
+		previewer.CameraUp() == pendingCamUp && previewer.CameraFocal() == pendingCamFocal &&
+		previewer.CameraFovy() == pendingCamFovy && previewer.CameraFocalDist() == pendingCamFocalDist &&
+		previewer.CameraF() == pendingCamF)
+		return false;
+
+	pendingCamPos = previewer.CameraPosition();
+	pendingCamDir = previewer.CameraDirection();
+	pendingCamUp = previewer.CameraUp();
+	pendingCamFocal = previewer.CameraFocal();
+	pendingCamFovy = previewer.CameraFovy();
+	pendingCamFocalDist = previewer.CameraFocalDist();
+	pendingCamF = previewer.CameraF();
+	return true;
+}
+
+// Queues the previewer camera for the path tracer thread, returns false if it did not change
+bool QueueCamera()
+{
+	std::lock_guard<std::mutex> lock(renderMutex);
+	if (!SyncPendingCamera())
+		return false;
+	cameraPending = true;
+	return true;
+}
+
+void MarkSceneChange(SceneChange change)
+{
+	std::lock_guard<std::mutex> lock(renderMutex);
+	if (change > sceneChange)
+		sceneChange = change;
+}
+
 void ClearScene()
 {
 	previewer.ClearScene();
+	MarkSceneChange(SceneChange::SCENE);
 
 	preview = true;
 	lastSelectedId = -1;
 
 	traceDepth = 3;
+	envMapFile = "";
+	envIntensity = 1.0f;
 	wRender = 1024;
 	hRender = 768;
 	autoRes = false;
@@ -394,6 +501,11 @@ void LoadScene(const std::string& file)
 			fr >> val;
 			if (fr.eof()) { fr.close(); return; }
 			m.emissiveIntensity = val;
+			// The light group follows on the same line, files saved before it was stored have none
+			if (!std::getline(fr, line)) { fr.close(); return; }
+			std::istringstream group(line);
+			if (group >> ival)
+				m.lightGroup = glm::clamp(ival, 0, MAX_LIGHT_GROUPS - 1);
 
 			fr >> ival;
 			if (fr.eof()) { fr.close(); return; }
@@ -428,6 +540,15 @@ void LoadScene(const std::string& file)
 		}
 	}
 
+	// Files saved before the environment was stored end here
+	if (std::getline(fr, line))
+	{
+		envMapFile = line;
+		fr >> val;
+		if (!fr.fail())
+			envIntensity = val;
+	}
+
 	fr.close();
 
 	editingRedirObjects.swap(std::vector<RedirObject>());
@@ -574,6 +695,7 @@ void LoadObjectPathsFromSceneFile(const std::string& file)
 
 			fr >> val;
 			if (fr.eof()) { fr.close(); return; }
+			if (!std::getline(fr, line)) { fr.close(); return; }
 
 			fr >> ival;
 			if (fr.eof()) { fr.close(); return; }
@@ -660,6 +782,8 @@ void SaveAt(std::string path)
 	fw << v3.x << " " << v3.y << " " << v3.z << "\n";
 	v3 = previewer.CameraRotation();
 	fw << v3.x << " " << v3.y << " " << v3.z << "\n";
+	fw << previewer.CameraFocalDist() << "\n";
+	fw << previewer.CameraF() << "\n";
 
 	auto objs = previewer.GetLoadedObjects();
 	fw << objs.size() << "\n";
@@ -683,15 +807,24 @@ void SaveAt(std::string path)
 			fw << v3.x << " " << v3.y << " " << v3.z << "\n";
 			v3 = element.material.emissive;
 			fw << v3.x << " " << v3.y << " " << v3.z << "\n";
-			fw << element.material.emissiveIntensity << "\n";
+			fw << element.material.emissiveIntensity << " " << element.material.lightGroup << "\n";
 			fw << (int)element.material.type << "\n";
 			fw << element.material.roughness << "\n";
 			fw << element.material.reflectiveness << "\n";
+			fw << element.material.translucency << "\n";
 			fw << element.material.ior << "\n";
+			fw << element.diffuseTexFile << "\n";
 			fw << element.normalTexFile << "\n";
+			fw << element.emissTexFile << "\n";
+			fw << element.roughnessTexFile << "\n";
+			fw << element.metallicTexFile << "\n";
+			fw << element.opacityTexFile << "\n";
 		}
 	}
 
+	fw << envMapFile << "\n";
+	fw << envIntensity << "\n";
+
 	fw.close();
 
 	statusText = "Saved scene at: " + path;
@@ -704,6 +837,7 @@ void Save()
 	if (!stop && !init)
 		pause = true;
 	saveFile = true;
+	WakePathTracer();
 }
 
 void SaveAs()
@@ -731,6 +865,7 @@ void SaveAs()
 		if (!stop && !init)
 			pause = true;
 		saveFile = true;
+		WakePathTracer();
 	}
 	else
 		AfterSaving();
@@ -764,7 +899,61 @@ void ExportAt(const std::string& path)
 
     stbi_flip_vertically_on_write(true);
     GLuint channel = 3; // rgb
-    stbi_write_png(path.c_str(), wRender, hRender, channel, texData, channel * wRender);
+    GLubyte* exportData = new GLubyte[wRender * hRender * channel];
+    if (!pathTracer.ResolveImage(exportData, denoiseExport))
+    {
+        // Nothing left to resolve, export what was last displayed
+        const Frame* frame = pathTracer.GetPublishedFrame();
+        if (frame && frame->resolution == glm::ivec2(wRender, hRender))
+            memcpy(exportData, frame->pixels.data(), wRender * hRender * channel);
+        else
+            memset(exportData, 0, wRender * hRender * channel);
+    }
+    stbi_write_png(path.c_str(), wRender, hRender, channel, exportData, channel * wRender);
+
+    if (exportAovs)
+    {
+        // Written next to the beauty as <name>_<aov>, unbounded AOVs as HDR
+        const AovType aovs[] =
+        {
+            AovType::ALBEDO, AovType::NORMAL, AovType::DEPTH,
+            AovType::OBJECT_ID, AovType::ELEMENT_ID, AovType::SAMPLES
+        };
+        const char* aovNames[] = { "albedo", "normal", "depth", "objectid", "elementid", "samples" };
+        std::string stem = path.substr(0, path.find_last_of('.'));
+        float* aovData = new float[wRender * hRender * channel];
+        for (int a = 0; a < 6; a++)
+        {
+            if (!pathTracer.ResolveAov(aovs[a], aovData))
+                break;
+            std::string aovPath = stem + "_" + aovNames[a];
+            if (aovs[a] == AovType::DEPTH || aovs[a] == AovType::SAMPLES)
+            {
+                aovPath += ".hdr";
+                stbi_write_hdr(aovPath.c_str(), wRender, hRender, channel, aovData);
+            }
+            else
+            {
+                for (int i = 0; i < wRender * hRender * (int)channel; i++)
+                    exportData[i] = glm::clamp(aovData[i], 0.0f, 1.0f) * 255;
+                aovPath += ".png";
+                stbi_write_png(aovPath.c_str(), wRender, hRender, channel, exportData, channel * wRender);
+            }
+        }
+
+        // Light groups, the last one holds the environment
+        int numGroups = pathTracer.GetLightGroupCount();
+        for (int g = 0; g < numGroups; g++)
+        {
+            if (!pathTracer.ResolveLightGroup(g, aovData))
+                break;
+            std::string groupPath = stem + "_" +
+                (g == numGroups - 1 ? std::string("environment") : "lightgroup" + std::to_string(g)) + ".hdr";
+            stbi_write_hdr(groupPath.c_str(), wRender, hRender, channel, aovData);
+        }
+        delete[] aovData;
+    }
+    delete[] exportData;
 
 	statusText = "Exported file at: " + path;
 	statusShowBegin = std::chrono::steady_clock::now();
@@ -807,6 +996,7 @@ void Export()
 		if (!stop && !init)
 			pause = true;
 		exportFile = true;
+		WakePathTracer();
 	}
 }
 
@@ -821,6 +1011,7 @@ void LoadObject()
 	std::string objPath = PathUtil::UniversalPath(objPath_c);
 	pwd_r = objPath.substr(0, objPath.find_last_of('/'));
 	previewer.LoadObject(objPath);
+	MarkSceneChange(SceneChange::SCENE);
 	preview = true;
 	sceneModified = true;
 
@@ -840,6 +1031,7 @@ void ReplaceWith()
 		pwd_r = objPath.substr(0, objPath.find_last_of('/'));
 
 		previewer.ReplaceSelectedObjectsWith(objPath);
+		MarkSceneChange(SceneChange::SCENE);
 		sceneModified = true;
 	}
 }
@@ -853,11 +1045,115 @@ std::string LoadImage()
 		return "";
 	return imgPath_c;
 }
+
+std::string LoadEnvironmentImage()
+{
+	const char* filterItems[6] = { "*.hdr", "*.jpg", "*.jpeg", "*.png", "*.bmp", "*.tga" };
+	const char* filterDesc = "Image Files (*.hdr;*.jpg;*.jpeg;*.png;*.bmp;*.tga)";
+	auto imgPath_c = tinyfd_openFileDialog("Load Environment Map", pwd_r.c_str(), 6, filterItems, filterDesc, 0);
+	if (!imgPath_c)
+		return "";
+	return imgPath_c;
+}
 /* ----- TOOL FUNCTIONS ------ */
 
 void InitializeFrame();
 void InitializeGLFrame();
 
+void StartRender()
+{
+	if (restart || init || stop)
+	{
+		init = true;
+		InitializeFrame();
+	}
+	render = true;
+	preview = false;
+	glfwSetTime(timePause); // reset timer
+	WakePathTracer();
+}
+
+void PauseRender()
+{
+	render = false;
+	pause = true;
+	WakePathTracer();
+}
+
+void StopRender()
+{
+	render = false;
+	restart = false;
+	pause = false;
+	isPausing = false;
+	pathTracer.Exit();
+	glfwSetTime(timePause); // reset timer
+	stop = true;
+	WakePathTracer();
+}
+
+void RestartRender()
+{
+	render = true;
+	preview = false;
+	restart = true;
+	pathTracer.Exit();
+	WakePathTracer();
+}
+
+// The edit and its scene change are queued together, the restart that follows takes both
+void QueueMaterialEdit(const std::function<void()>& edit)
+{
+	{
+		std::lock_guard<std::mutex> lock(renderMutex);
+		pendingMaterialEdits.push_back(edit);
+		if (SceneChange::MATERIAL > sceneChange)
+			sceneChange = SceneChange::MATERIAL;
+	}
+	RestartRender();
+}
+
+// A material edit on a loaded scene is patched into the path tracer in place
+void MaterialEdited(int objId, int elementId)
+{
+	sceneModified = true;
+	if (init || stop)
+		return;
+	Material material = previewer.GetLoadedObjects()[objId].elements[elementId].material;
+	QueueMaterialEdit([=]() mutable
+	{
+		pathTracer.SetMaterial(objId, elementId, material);
+	});
+}
+
+void TextureEdited
+(
+	int objId, int elementId,
+	void (PathTracer::*setTexture)(int, int, const std::string&), const std::string& file
+)
+{
+	sceneModified = true;
+	if (init || stop)
+		return;
+	QueueMaterialEdit([=]()
+	{
+		(pathTracer.*setTexture)(objId, elementId, file);
+	});
+}
+
+// A camera edit on a loaded scene only restarts the accumulation
+void CameraEdited()
+{
+	sceneModified = true;
+	if (init || stop)
+		return;
+	if (QueueCamera())
+	{
+		MarkSceneChange(SceneChange::CAMERA);
+		RestartRender();
+	}
+}
+
 /* ----- GUI FUNCTIONS ------ */
 void GuiInputContextMenu()
 {
@@ -1103,6 +1399,7 @@ void GuiMenuBar()
 			{
 				lastSelectedId = -1;
 				previewer.DeleteSelectedObjects();
+				MarkSceneChange(SceneChange::SCENE);
 				sceneModified = true;
 			}
 
@@ -1129,38 +1426,13 @@ void GuiMenuBar()
 		if (ImGui::BeginMenu("Render"))
 		{
 			if (ImGui::MenuItem("Start", ICON_FK_PLAY, "F5, SHIFT+B", false, canStart))
-			{
-				if (restart || init || stop)
-				{
-					init = true;
-					InitializeFrame();
-				}
-				render = true;
-				preview = false;
-				glfwSetTime(timePause); // reset timer
-			}
+				StartRender();
 			if (ImGui::MenuItem("Pause", ICON_FK_PAUSE, "F6, SHIFT+P", false, canPause))
-			{
-				render = false;
-				pause = true;
-			}
+				PauseRender();
 			if (ImGui::MenuItem("Stop", ICON_FK_STOP, "F7, SHIFT+S", false, canStop))
-			{
-				render = false;
-				restart = false;
-				pause = false;
-				isPausing = false;
-				pathTracer.Exit();
-				glfwSetTime(timePause); // reset timer
-				stop = true;
-			}
+				StopRender();
 			if (ImGui::MenuItem("Resart", ICON_FK_UNDO, "F8, SHIFT+R", false, canRestart))
-			{
-				render = true;
-				preview = false;
-				restart = true;
-				pathTracer.Exit();
-			}
+				RestartRender();
 			ImGui::EndMenu();
 		}
 
@@ -1292,16 +1564,7 @@ void GuiToolbar()
 			canPause = false;
 			ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.5f, 0.8f, 0.5f, 1.0f));
 			if (ImGui::SmallButton(ICON_FK_PLAY))
-			{
-				if (restart || init || stop)
-				{
-					init = true;
-					InitializeFrame();
-				}
-				render = true;
-				preview = false;
-				glfwSetTime(timePause); // reset timer
-			}
+				StartRender();
 		}
 	}
 	else
@@ -1319,10 +1582,7 @@ void GuiToolbar()
 			canPause = true;
 			ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.9f, 0.9f, 0.9f, 1.0f));
 			if (ImGui::SmallButton(ICON_FK_PAUSE))
-			{
-				render = false;
-				pause = true;
-			}
+				PauseRender();
 		}
 	}
 	ImGui::PopStyleColor();
@@ -1339,15 +1599,7 @@ void GuiToolbar()
 		canStop = true;
 		ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.0f, 0.3f, 0.3f, 1.0f));
 		if (ImGui::SmallButton(ICON_FK_STOP))
-		{
-			render = false;
-			restart = false;
-			pause = false;
-			isPausing = false;
-			pathTracer.Exit();
-			glfwSetTime(timePause); // reset timer
-			stop = true;
-		}
+			StopRender();
 	}
 	ImGui::PopStyleColor();
 
@@ -1365,12 +1617,7 @@ void GuiToolbar()
 			canRestart = true;
 			ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.9f, 0.9f, 0.9f, 1.0f));
 			if (ImGui::SmallButton(ICON_FK_UNDO))
-			{
-				render = true;
-				preview = false;
-				restart = true;
-				pathTracer.Exit();
-			}
+				RestartRender();
 		}
 	}
 	else
@@ -1473,6 +1720,13 @@ void GuiRightBar()
 			sceneModified = true;
 		GuiInputContextMenu();
 
+		ImGui::Text("Roulette Depth");
+		ImGui::SameLine(160);
+		ImGui::SetNextItemWidth(150);
+		ImGui::SliderInt("##rouletteDepth", &rouletteDepth, 0, 10, "%d",
+			ImGuiSliderFlags_AlwaysClamp);
+		GuiInputContextMenu();
+
 		if (autoRes)
 			ImGui::BeginDisabled();
 
@@ -1506,17 +1760,132 @@ void GuiRightBar()
 		if (ImGui::Checkbox("##autoRes", &autoRes))
 			sceneModified = true;
 
+		ImGui::Text("Adaptive Sampling");
+		ImGui::SameLine(160);
+		ImGui::Checkbox("##adaptiveSampling", &adaptiveSampling);
+
+		if (!adaptiveSampling)
+			ImGui::BeginDisabled();
+
+		ImGui::Text("Noise Threshold");
+		ImGui::SameLine(160);
+		ImGui::SetNextItemWidth(150);
+		ImGui::SliderFloat("##adaptiveThreshold", &adaptiveThreshold, 0.001f, 0.1f, "%.3f",
+			ImGuiSliderFlags_AlwaysClamp | ImGuiSliderFlags_Logarithmic);
+		GuiInputContextMenu();
+
+		if (!adaptiveSampling)
+			ImGui::EndDisabled();
+
+		ImGui::Text("Light Groups");
+		ImGui::SameLine(160);
+		ImGui::Checkbox("##lightGroups", &lightGroups);
+
+		ImGui::Text("Pack Material Maps");
+		ImGui::SameLine(160);
+		ImGui::Checkbox("##packMaterialMaps", &packMaterialMaps);
+
+		ImGui::Text("Compress Textures");
+		ImGui::SameLine(160);
+		if (ImGui::Checkbox("##compressTextures", &compressTextures))
+			TextureCache::SetCompression(compressTextures);
+		if (ImGui::IsItemHovered())
+			ImGui::SetTooltip("Block compress the textures loaded from now on");
+
+		ImGui::Text("Texture Memory");
+		ImGui::SameLine(160);
+		ImGui::SetNextItemWidth(150);
+		ImGui::SliderInt("##textureBudget", &textureBudget, 64, 16384, "%d MB",
+			ImGuiSliderFlags_AlwaysClamp | ImGuiSliderFlags_Logarithmic);
+		if (ImGui::IsItemHovered())
+			ImGui::SetTooltip("Tiles of large textures in memory: %d MB", (int)(TileCache::GetResidentBytes() >> 20));
+		GuiInputContextMenu();
+		// Also catches edits from the context menu
+		if (((size_t)textureBudget << 20) != TileCache::GetBudget())
+			TileCache::SetBudget((size_t)textureBudget << 20);
+
+		ImGui::Text("Samples per Pass");
+		ImGui::SameLine(160);
+		ImGui::SetNextItemWidth(150);
+		ImGui::SliderInt("##samplesPerPass", &samplesPerPass, 1, 64, "%d",
+			ImGuiSliderFlags_AlwaysClamp | ImGuiSliderFlags_Logarithmic);
+		GuiInputContextMenu();
+
+		// Low resolution frames adapt their size to this while the camera is navigated
+		ImGui::Text("Navigation Frame");
+		ImGui::SameLine(160);
+		ImGui::SetNextItemWidth(150);
+		ImGui::SliderFloat("##navigationFrameTime", &navigationFrameTime, 8.0f, 200.0f, "%.0f ms",
+			ImGuiSliderFlags_AlwaysClamp | ImGuiSliderFlags_Logarithmic);
+		GuiInputContextMenu();
+
+		// 0 uses every core except the reserved ones
+		ImGui::Text("Render Threads");
+		ImGui::SameLine(160);
+		ImGui::SetNextItemWidth(150);
+		ImGui::SliderInt("##renderThreads", &renderThreads, 0, 256, renderThreads == 0 ? "Auto" : "%d",
+			ImGuiSliderFlags_AlwaysClamp);
+		GuiInputContextMenu();
+
+		if (renderThreads != 0)
+			ImGui::BeginDisabled();
+
+		ImGui::Text("Reserved Threads");
+		ImGui::SameLine(160);
+		ImGui::SetNextItemWidth(150);
+		ImGui::SliderInt("##reservedThreads", &reservedThreads, 0, 16, "%d",
+			ImGuiSliderFlags_AlwaysClamp);
+		GuiInputContextMenu();
+
+		if (renderThreads != 0)
+			ImGui::EndDisabled();
+
 		if (!(init || stop) || render)
 			ImGui::EndDisabled();
+
+		// Denoising only affects the resolved output, so it can be toggled while rendering
+		ImGui::Text("Denoise");
+		ImGui::SameLine(160);
+		if (ImGui::Checkbox("##denoise", &denoise))
+		{
+			pathTracer.SetDenoise(denoise);
+			pathTracer.InvalidateFrame();
+			WakePathTracer();
+		}
+
+		ImGui::Text("Tonemap");
+		ImGui::SameLine(160);
+		ImGui::SetNextItemWidth(150);
+		if (ImGui::Combo("##tonemap", &tonemapOperator, "Clamp\0Reinhard\0ACES\0"))
+		{
+			pathTracer.SetTonemapOperator((TonemapOperator)tonemapOperator);
+			pathTracer.InvalidateFrame();
+			WakePathTracer();
+		}
+
+		ImGui::Text("sRGB Output");
+		ImGui::SameLine(160);
+		if (ImGui::Checkbox("##srgbOutput", &srgbOutput))
+		{
+			pathTracer.SetSrgbOutput(srgbOutput);
+			pathTracer.InvalidateFrame();
+			WakePathTracer();
+		}
+
+		ImGui::Text("Denoise Export");
+		ImGui::SameLine(160);
+		ImGui::Checkbox("##denoiseExport", &denoiseExport);
+
+		ImGui::Text("Export AOVs");
+		ImGui::SameLine(160);
+		ImGui::Checkbox("##exportAovs", &exportAovs);
 		ImGui::TreePop();
 	}
 
 	ImGui::SetNextItemOpen(true, ImGuiCond_Once);
 	if (ImGui::TreeNodeEx("Camera", ImGuiTreeNodeFlags_SpanAvailWidth))
 	{
-		if (!(init || stop) || render)
-			ImGui::BeginDisabled();
-
+		// Camera edits stay enabled while rendering, they only restart the accumulation
 		float fv = previewer.CameraFocalDist();
 		ImGui::Text("Focal Distance");
 		ImGui::SameLine(160);
@@ -1525,7 +1894,7 @@ void GuiRightBar()
 			ImGuiSliderFlags_AlwaysClamp))
 		{
 			previewer.SetCameraFocalDist(fv);
-			sceneModified = true;
+			CameraEdited();
 		}
 		GuiInputContextMenu();
 
@@ -1537,7 +1906,7 @@ void GuiRightBar()
 			ImGuiSliderFlags_AlwaysClamp))
 		{
 			previewer.SetCameraF(fv);
-			sceneModified = true;
+			CameraEdited();
 		}
 		GuiInputContextMenu();
 
@@ -1552,8 +1921,9 @@ void GuiRightBar()
 		{
 			previewer.SetCamera(glm::vec3(v3[0], v3[1], v3[2]),
 				previewer.CameraDirection(), previewer.CameraUp());
-			preview = true;
-			sceneModified = true;
+			if (init || stop)
+				preview = true;
+			CameraEdited();
 		}
 		GuiInputContextMenu();
 
@@ -1566,11 +1936,58 @@ void GuiRightBar()
 		if (ImGui::DragFloat3("##cameraRot", v3, 1.0f, 0.0f, 0.0f, "%.2f"))
 		{
 			previewer.RotateCamera(glm::vec3(v3[0], v3[1], v3[2]));
-			preview = true;
-			sceneModified = true;
+			if (init || stop)
+				preview = true;
+			CameraEdited();
 		}
 		GuiInputContextMenu();
 
+		ImGui::TreePop();
+	}
+
+	ImGui::SetNextItemOpen(true, ImGuiCond_Once);
+	if (ImGui::TreeNodeEx("Environment", ImGuiTreeNodeFlags_SpanAvailWidth))
+	{
+		if (!(init || stop) || render)
+			ImGui::BeginDisabled();
+
+		int posY = ImGui::GetCursorPosY();
+		ImGui::SetCursorPosY(posY + (ImGui::GetFrameHeight() - ImGui::GetTextLineHeight()) * 0.5f);
+		ImGui::Text("Environment Map");
+		ImGui::SameLine(160);
+		ImGui::SetCursorPosY(posY);
+		ImGui::SetNextItemWidth(150);
+		std::string envName = envMapFile.substr(envMapFile.find_last_of('/') + 1);
+		if (envName.size() == 0)
+			envName = "None";
+		ImGui::InputText("##envMap", &envName, ImGuiInputTextFlags_ReadOnly);
+
+		ImGui::PushStyleVar(ImGuiStyleVar_ButtonTextAlign, ImVec2(0.0f, 0.5f));
+		ImGui::PushFont(normalIconFont);
+		ImGui::SetCursorPosX(160);
+		if (ImGui::Button("Load##envMap", ImVec2(65, 23)))
+		{
+			std::string imgPath = LoadEnvironmentImage();
+			if (imgPath.size() != 0)
+				envMapFile = PathUtil::UniversalPath(imgPath);
+		}
+		ImGui::SameLine();
+		if (envMapFile.size() == 0)
+			ImGui::BeginDisabled();
+		if (ImGui::Button("Remove##envMap", ImVec2(65, 23)))
+			envMapFile = "";
+		if (envMapFile.size() == 0)
+			ImGui::EndDisabled();
+		ImGui::PopFont();
+		ImGui::PopStyleVar();
+
+		ImGui::Text("Intensity");
+		ImGui::SameLine(160);
+		ImGui::SetNextItemWidth(150);
+		ImGui::DragFloat("##envIntensity", &envIntensity, 0.1f, 0.0f, 65535.0f, "%.2f",
+			ImGuiSliderFlags_AlwaysClamp);
+		GuiInputContextMenu();
+
 		if (!(init || stop) || render)
 			ImGui::EndDisabled();
 		ImGui::TreePop();
@@ -1579,8 +1996,8 @@ void GuiRightBar()
 	ImGui::SetNextItemOpen(true, ImGuiCond_Once);
 	if (ImGui::TreeNodeEx("Scene", ImGuiTreeNodeFlags_SpanAvailWidth))
 	{
-		if (!(init || stop) || render)
-			ImGui::BeginDisabled();
+		// Only materials stay editable on a loaded scene, they are patched into the path tracer
+		bool sceneLoaded = !(init || stop) || render;
 
 		int posY = ImGui::GetCursorPosY();
 		ImGui::SetCursorPosY(posY + (ImGui::GetFrameHeight() - ImGui::GetTextLineHeight()) * 0.5f);
@@ -1592,8 +2009,12 @@ void GuiRightBar()
 
 		ImGui::SameLine(ImGui::GetContentRegionMax().x - 80.0f - ImGui::GetStyle().WindowPadding.x);
 		ImGui::SetCursorPosY(posY);
+		if (sceneLoaded)
+			ImGui::BeginDisabled();
 		if (ImGui::IconButton(ICON_FK_PLUS, "  Add##obj", ImVec4(0.4f, 0.8f, 0.4f, 1.0f), ImVec2(70, 25)))
 			LoadObject();
+		if (sceneLoaded)
+			ImGui::EndDisabled();
 
 		auto& objs = previewer.GetLoadedObjects();
 		int selectedId = -1;
@@ -1632,12 +2053,13 @@ void GuiRightBar()
 				if (!objs[i].isSelected)
 					selectedId = i;
 
-				if (ImGui::MenuItem("Replace With...", "CTRL+R"))
+				if (ImGui::MenuItem("Replace With...", "CTRL+R", false, !sceneLoaded))
 					ReplaceWith();
-				if (ImGui::MenuItem("Delete", ICON_FK_TRASH, "DELETE"))
+				if (ImGui::MenuItem("Delete", ICON_FK_TRASH, "DELETE", false, !sceneLoaded))
 				{
 					lastSelectedId = -1;
 					previewer.DeleteSelectedObjects();
+					MarkSceneChange(SceneChange::SCENE);
 					sceneModified = true;
 				}
 				ImGui::Separator();
@@ -1660,6 +2082,9 @@ void GuiRightBar()
 				selectedId = i;
 			if (nodeOpen)
 			{
+				if (sceneLoaded)
+					ImGui::BeginDisabled();
+
 				ImGui::Text("Name");
 				ImGui::SameLine(160);
 				ImGui::SetNextItemWidth(200);
@@ -1728,6 +2153,9 @@ void GuiRightBar()
 				}
 				GuiInputContextMenu();
 
+				if (sceneLoaded)
+					ImGui::EndDisabled();
+
 				for (int j = 0; j < objs[i].elements.size(); j++)
 				{
 					std::string elementName = objs[i].elements[j].name;
@@ -1746,6 +2174,8 @@ void GuiRightBar()
 					if (ImGui::TreeNodeEx(idStr.c_str(), ImGuiTreeNodeFlags_SpanAvailWidth,
 						elementName.c_str()))
 					{
+						if (sceneLoaded)
+							ImGui::BeginDisabled();
 						ImGui::Text("Name");
 						ImGui::SameLine(160);
 						ImGui::SetNextItemWidth(200);
@@ -1757,6 +2187,8 @@ void GuiRightBar()
 							sceneModified = true;
 						}
 						GuiInputContextMenu();
+						if (sceneLoaded)
+							ImGui::EndDisabled();
 
 						ImGui::Text("Diffuse Color");
 						ImGui::SameLine(160);
@@ -1773,8 +2205,9 @@ void GuiRightBar()
 							Material& m = objs[i].elements[j].material;
 							m.diffuse = glm::vec3(v3[0], v3[1], v3[2]);
 							previewer.SetMaterial(i, j, m);
-							preview = true;
-							sceneModified = true;
+							if (init || stop)
+								preview = true;
+							MaterialEdited(i, j);
 						}
 						ImGui::PopStyleColor();
 						ImGui::PopStyleVar();
@@ -1795,8 +2228,9 @@ void GuiRightBar()
 							Material& m = objs[i].elements[j].material;
 							m.specular = glm::vec3(v3[0], v3[1], v3[2]);
 							previewer.SetMaterial(i, j, m);
-							preview = true;
-							sceneModified = true;
+							if (init || stop)
+								preview = true;
+							MaterialEdited(i, j);
 						}
 						ImGui::PopStyleColor();
 						ImGui::PopStyleVar();
@@ -1817,8 +2251,9 @@ void GuiRightBar()
 							Material& m = objs[i].elements[j].material;
 							m.emissive = glm::vec3(v3[0], v3[1], v3[2]);
 							previewer.SetMaterial(i, j, m);
-							preview = true;
-							sceneModified = true;
+							if (init || stop)
+								preview = true;
+							MaterialEdited(i, j);
 						}
 						ImGui::PopStyleColor();
 						ImGui::PopStyleVar();
@@ -1835,8 +2270,24 @@ void GuiRightBar()
 							Material& m = objs[i].elements[j].material;
 							m.emissiveIntensity = val;
 							previewer.SetMaterial(i, j, m);
-							preview = true;
-							sceneModified = true;
+							if (init || stop)
+								preview = true;
+							MaterialEdited(i, j);
+						}
+						GuiInputContextMenu();
+
+						ImGui::Text("Light Group");
+						ImGui::SameLine(160);
+						ImGui::SetNextItemWidth(150);
+						int group = objs[i].elements[j].material.lightGroup;
+						idSubStr = "##lightGroup" + idStr;
+						if (ImGui::SliderInt(idSubStr.c_str(), &group, 0, MAX_LIGHT_GROUPS - 1, "%d",
+							ImGuiSliderFlags_AlwaysClamp))
+						{
+							Material& m = objs[i].elements[j].material;
+							m.lightGroup = group;
+							previewer.SetMaterial(i, j, m);
+							MaterialEdited(i, j);
 						}
 						GuiInputContextMenu();
 
@@ -1853,7 +2304,7 @@ void GuiRightBar()
 							Material& m = objs[i].elements[j].material;
 							m.type = (MaterialType)iVal;
 							previewer.SetMaterial(i, j, m);
-							sceneModified = true;
+							MaterialEdited(i, j);
 						}
 
 						val = objs[i].elements[j].material.roughness;
@@ -1867,7 +2318,7 @@ void GuiRightBar()
 							Material& m = objs[i].elements[j].material;
 							m.roughness = val;
 							previewer.SetMaterial(i, j, m);
-							sceneModified = true;
+							MaterialEdited(i, j);
 						}
 
 						val = objs[i].elements[j].material.reflectiveness;
@@ -1881,7 +2332,7 @@ void GuiRightBar()
 							Material& m = objs[i].elements[j].material;
 							m.reflectiveness = val;
 							previewer.SetMaterial(i, j, m);
-							sceneModified = true;
+							MaterialEdited(i, j);
 						}
 
 						if (objs[i].elements[j].material.type == MaterialType::TRANSLUCENT)
@@ -1897,7 +2348,7 @@ void GuiRightBar()
 								Material& m = objs[i].elements[j].material;
 								m.translucency = val;
 								previewer.SetMaterial(i, j, m);
-								sceneModified = true;
+								MaterialEdited(i, j);
 							}
 
 							val = objs[i].elements[j].material.ior;
@@ -1914,7 +2365,7 @@ void GuiRightBar()
 								Material& m = objs[i].elements[j].material;
 								m.ior = val;
 								previewer.SetMaterial(i, j, m);
-								sceneModified = true;
+								MaterialEdited(i, j);
 							}
 							GuiInputContextMenu();
 						}
@@ -1940,8 +2391,9 @@ void GuiRightBar()
 							if (imgPath.size() != 0)
 							{
 								previewer.SetDiffuseTextureForElement(i, j, imgPath);
-								preview = true;
-								sceneModified = true;
+								if (init || stop)
+									preview = true;
+								TextureEdited(i, j, &PathTracer::SetDiffuseTextureForElement, imgPath);
 							}
 						}
 
@@ -1953,8 +2405,9 @@ void GuiRightBar()
 						if (ImGui::Button(idSubStr.c_str(), ImVec2(65, 23)))
 						{
 							previewer.SetDiffuseTextureForElement(i, j, "");
-							preview = true;
-							sceneModified = true;
+							if (init || stop)
+								preview = true;
+							TextureEdited(i, j, &PathTracer::SetDiffuseTextureForElement, "");
 						}
 						if (texId == -1)
 							ImGui::EndDisabled();
@@ -1982,8 +2435,9 @@ void GuiRightBar()
 							if (imgPath.size() != 0)
 							{
 								previewer.SetNormalTextureForElement(i, j, imgPath);
-								preview = true;
-								sceneModified = true;
+								if (init || stop)
+									preview = true;
+								TextureEdited(i, j, &PathTracer::SetNormalTextureForElement, imgPath);
 							}
 						}
 
@@ -1995,8 +2449,9 @@ void GuiRightBar()
 						if (ImGui::Button(idSubStr.c_str(), ImVec2(65, 23)))
 						{
 							previewer.SetNormalTextureForElement(i, j, "");
-							preview = true;
-							sceneModified = true;
+							if (init || stop)
+								preview = true;
+							TextureEdited(i, j, &PathTracer::SetNormalTextureForElement, "");
 						}
 						if (texId == -1)
 							ImGui::EndDisabled();
@@ -2024,8 +2479,9 @@ void GuiRightBar()
 							if (imgPath.size() != 0)
 							{
 								previewer.SetEmissTextureForElement(i, j, imgPath);
-								preview = true;
-								sceneModified = true;
+								if (init || stop)
+									preview = true;
+								TextureEdited(i, j, &PathTracer::SetEmissTextureForElement, imgPath);
 							}
 						}
 
@@ -2037,8 +2493,9 @@ void GuiRightBar()
 						if (ImGui::Button(idSubStr.c_str(), ImVec2(65, 23)))
 						{
 							previewer.SetEmissTextureForElement(i, j, "");
-							preview = true;
-							sceneModified = true;
+							if (init || stop)
+								preview = true;
+							TextureEdited(i, j, &PathTracer::SetEmissTextureForElement, "");
 						}
 						if (texId == -1)
 							ImGui::EndDisabled();
@@ -2066,8 +2523,9 @@ void GuiRightBar()
 							if (imgPath.size() != 0)
 							{
 								previewer.SetRoughnessTextureForElement(i, j, imgPath);
-								preview = true;
-								sceneModified = true;
+								if (init || stop)
+									preview = true;
+								TextureEdited(i, j, &PathTracer::SetRoughnessTextureForElement, imgPath);
 							}
 						}
 
@@ -2079,8 +2537,9 @@ void GuiRightBar()
 						if (ImGui::Button(idSubStr.c_str(), ImVec2(65, 23)))
 						{
 							previewer.SetRoughnessTextureForElement(i, j, "");
-							preview = true;
-							sceneModified = true;
+							if (init || stop)
+								preview = true;
+							TextureEdited(i, j, &PathTracer::SetRoughnessTextureForElement, "");
 						}
 						if (texId == -1)
 							ImGui::EndDisabled();
@@ -2108,8 +2567,9 @@ void GuiRightBar()
 							if (imgPath.size() != 0)
 							{
 								previewer.SetMetallicTextureForElement(i, j, imgPath);
-								preview = true;
-								sceneModified = true;
+								if (init || stop)
+									preview = true;
+								TextureEdited(i, j, &PathTracer::SetMetallicTextureForElement, imgPath);
 							}
 						}
 
@@ -2121,8 +2581,9 @@ void GuiRightBar()
 						if (ImGui::Button(idSubStr.c_str(), ImVec2(65, 23)))
 						{
 							previewer.SetMetallicTextureForElement(i, j, "");
-							preview = true;
-							sceneModified = true;
+							if (init || stop)
+								preview = true;
+							TextureEdited(i, j, &PathTracer::SetMetallicTextureForElement, "");
 						}
 						if (texId == -1)
 							ImGui::EndDisabled();
@@ -2150,8 +2611,9 @@ void GuiRightBar()
 							if (imgPath.size() != 0)
 							{
 								previewer.SetOpacityTextureForElement(i, j, imgPath);
-								preview = true;
-								sceneModified = true;
+								if (init || stop)
+									preview = true;
+								TextureEdited(i, j, &PathTracer::SetOpacityTextureForElement, imgPath);
 							}
 						}
 
@@ -2163,8 +2625,9 @@ void GuiRightBar()
 						if (ImGui::Button(idSubStr.c_str(), ImVec2(65, 23)))
 						{
 							previewer.SetOpacityTextureForElement(i, j, "");
-							preview = true;
-							sceneModified = true;
+							if (init || stop)
+								preview = true;
+							TextureEdited(i, j, &PathTracer::SetOpacityTextureForElement, "");
 						}
 						if (texId == -1)
 							ImGui::EndDisabled();
@@ -2213,8 +2676,6 @@ void GuiRightBar()
 			lastSelectedId = selectedId;
 		}
 
-		if (!(init || stop) || render)
-			ImGui::EndDisabled();
 		ImGui::TreePop();
 	}
 
@@ -2302,7 +2763,10 @@ void GuiStausBar()
 	else
 	{
 		showProgressBar = true;
-		ImGui::TextClipped(ICON_FK_PENCIL_SQUARE_O "  Rendering,  samples: %.i", pathTracer.GetSamples());
+		if (navigating)
+			ImGui::TextClipped(ICON_FK_PENCIL_SQUARE_O "  Navigating,  1/%.i resolution", pathTracer.GetNavigationScale());
+		else
+			ImGui::TextClipped(ICON_FK_PENCIL_SQUARE_O "  Rendering,  samples: %.i", pathTracer.GetSamples());
 	}
 
 	ImGui::SameLine(ImGui::GetWindowWidth() - 620 - 40);
@@ -2323,6 +2787,8 @@ void GuiStausBar()
 		else
 			ImGui::TextClipped(ICON_FK_TACHOMETER "  Avg Time per Sample: %.2f s", glfwGetTime() / pathTracer.GetSamples());
 	}
+	if (ImGui::IsItemHovered())
+		ImGui::SetTooltip("Render thread wake-up latency: %.3f ms", wakeLatency.load());
 
 	ImGui::SameLine(ImGui::GetWindowWidth() - 390 - 40);
 	ImGui::VerticalSeparator();
@@ -2816,6 +3282,9 @@ void Display()
 		resChanged = false;
 	}
 
+	// Textures show up in the preview as their decodes finish
+	previewer.UploadTextures();
+
 	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
 	glViewport(0, 0, wRender, hRender);
 
@@ -3015,17 +3484,34 @@ void Idle()
 		previewer.SetCamera(camPos, previewer.CameraDirection(), previewer.CameraUp());
 
 		sceneModified = true;
+
+		// Navigating the path tracer output hands every camera change to the render thread
+		if (!preview && render)
+		{
+			if (QueueCamera())
+			{
+				navigating = true;
+				WakePathTracer();
+			}
+		}
 	}
 
 	Display();
 
 	// Only refresh result image on rendering
-	if (((init || stop || isPausing) && !render) || preview)
+	if (((init || stop) && !render) || preview)
+		return;
+
+	// Show the newest frame the path tracer published, if there is one
+	if (!pathTracer.AcquireFrame())
+		return;
+	const Frame& frame = pathTracer.GetFrame();
+	if (frame.resolution != glm::ivec2(wRender, hRender))
 		return;
 
 	glBindTexture(GL_TEXTURE_2D, frameTex);
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, wRender, hRender, GL_RGB, GL_UNSIGNED_BYTE, texData);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, wRender, hRender, GL_RGB, GL_UNSIGNED_BYTE, frame.pixels.data());
 	glBindTexture(GL_TEXTURE_2D, 0);
 }
 
@@ -3063,15 +3549,7 @@ void Kbd(GLFWwindow* window, int key, int scancode, int action, int mods)
 			}
 
 			else if (mods == GLFW_MOD_SHIFT && canStop) // SHIFT+S = Stop
-			{
-				render = false;
-				restart = false;
-				pause = false;
-				isPausing = false;
-				pathTracer.Exit();
-				glfwSetTime(timePause);
-				stop = true;
-			}
+				StopRender();
 
 			break;
 
@@ -3096,34 +3574,17 @@ void Kbd(GLFWwindow* window, int key, int scancode, int action, int mods)
 
 		case GLFW_KEY_B:
 			if (mods == GLFW_MOD_SHIFT && canStart) // SHIFT+B = Start
-			{
-				if (restart || init || stop)
-				{
-					init = true;
-					InitializeFrame();
-				}
-				render = true;
-				preview = false;
-				glfwSetTime(timePause);
-			}
+				StartRender();
 			break;
 		case GLFW_KEY_P:
 			if (mods == GLFW_MOD_SHIFT && canPause) // SHIFT+P = Pause
-			{
-				render = false;
-				pause = true;
-			}
+				PauseRender();
 			break;
 		case GLFW_KEY_R:
 			if (mods == GLFW_MOD_SHIFT && canRestart) // SHIFT+R = Restart
-			{
-				render = true;
-				preview = false;
-				restart = true;
-				pathTracer.Exit();
-			}
+				RestartRender();
 
-			else if (mods == GLFW_MOD_CONTROL) // CTRL+R = Replace With
+			else if (mods == GLFW_MOD_CONTROL && canLoad) // CTRL+R = Replace With
 			{
 				if (previewer.GetNumSelectedObjects() > 0)
 					ReplaceWith();
@@ -3140,50 +3601,29 @@ void Kbd(GLFWwindow* window, int key, int scancode, int action, int mods)
 			break;
 
 		case GLFW_KEY_DELETE: // DELETE = Delete Selected
-			lastSelectedId = -1;
-			previewer.DeleteSelectedObjects();
+			if (canLoad)
+			{
+				lastSelectedId = -1;
+				previewer.DeleteSelectedObjects();
+				MarkSceneChange(SceneChange::SCENE);
+			}
 			break;
 
 		case GLFW_KEY_F5:
 			if (canStart) // F5 = Start
-			{
-				if (restart || init || stop)
-				{
-					init = true;
-					InitializeFrame();
-				}
-				render = true;
-				preview = false;
-				glfwSetTime(timePause);
-			}
+				StartRender();
 			break;
 		case GLFW_KEY_F6:
 			if (canPause) // F6 = Pause
-			{
-				render = false;
-				pause = true;
-			}
+				PauseRender();
 			break;
 		case GLFW_KEY_F7:
 			if (canStop) // F7 = Stop
-			{
-				render = false;
-				restart = false;
-				pause = false;
-				isPausing = false;
-				pathTracer.Exit();
-				glfwSetTime(timePause);
-				stop = true;
-			}
+				StopRender();
 			break;
 		case GLFW_KEY_F8:
 			if (canRestart) // F8 = Restart
-			{
-				render = true;
-				preview = false;
-				restart = true;
-				pathTracer.Exit();
-			}
+				RestartRender();
 			break;
 		}
 	}
@@ -3247,8 +3687,8 @@ void Mouse(GLFWwindow* window, int button, int action, int mods)
 		pickedElementId = data[1] - 1;
 	}
 
-	// Right press: enter camera mouse control
-	else if (button == GLFW_MOUSE_BUTTON_RIGHT && preview && canLoad)
+	// Right press: enter camera mouse control, on the path tracer output while it renders too
+	else if (button == GLFW_MOUSE_BUTTON_RIGHT && ((preview && canLoad) || (!preview && render) || cameraMouseControl))
 	{
 		if (action == GLFW_PRESS)
 		{
@@ -3261,6 +3701,9 @@ void Mouse(GLFWwindow* window, int button, int action, int mods)
 				curPosDownX = curPosX;
 				curPosDownY = curPosY;
 				camRotDown = previewer.CameraRotation();
+				// Only real moves should switch to navigation frames
+				if (!preview && render)
+					QueueCamera();
 			}
 		}
 
@@ -3274,6 +3717,12 @@ void Mouse(GLFWwindow* window, int button, int action, int mods)
 				camMoveLeft = false;
 				camMoveRight = false;
 			}
+			// Back to full resolution accumulation
+			if (navigating)
+			{
+				navigating = false;
+				WakePathTracer();
+			}
 		}
 	}
 }
@@ -3302,6 +3751,7 @@ void DropFiles(GLFWwindow* window, int count, const char** paths)
 		else if (ext == ".obj")
 		{
 			previewer.LoadObject(filename);
+			MarkSceneChange(SceneChange::SCENE);
 			preview = true;
 			sceneModified = true;
 
@@ -3430,19 +3880,12 @@ void InitializeFrame()
 	if (frameTex == -1)
 	glGenTextures(1, &frameTex);
 	glBindTexture(GL_TEXTURE_2D, frameTex);
-	if (texData)
-		delete[] texData;
-	texData = new GLubyte[wRender * hRender * 3];
-	for (int i = 0; i < wRender * hRender * 3; i++)
-		texData[i] = 0;
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, wRender, hRender, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glBindTexture(GL_TEXTURE_2D, 0);
-
-	pathTracer.SetOutImage(texData);
 }
 
 void InitializeGLFrame()
@@ -3564,27 +4007,95 @@ void PathTracerLoop()
 {
 	while (!glfwWindowShouldClose(window))
 	{
+		bool passDone = false;
 		if (render)
 		{
 			isPausing = false;
-			if (restart || init || stop)
+
+			// Camera changes made while rendering, including navigation
+			SceneChange change = SceneChange::NONE;
+			bool restarting = false;
+			std::vector<std::function<void()>> materialEdits;
+			{
+				std::lock_guard<std::mutex> lock(renderMutex);
+				if (cameraPending)
+				{
+					pathTracer.SetCamera(pendingCamPos, pendingCamDir, pendingCamUp);
+					pathTracer.SetProjection(pendingCamFocal, pendingCamFovy);
+					pathTracer.SetCameraFocalDist(pendingCamFocalDist);
+					pathTracer.SetCameraAperture(pendingCamFocal / pendingCamF);
+					cameraPending = false;
+				}
+				// Scene changes wait for the restart that applies them. Clearing restart here
+				// keeps one requested after this point for the next iteration.
+				if (restart || init || stop)
+				{
+					restarting = true;
+					restart = false;
+					change = sceneChange;
+					sceneChange = SceneChange::NONE;
+					materialEdits.swap(pendingMaterialEdits);
+				}
+			}
+
+			if (restarting)
 			{
-				pathTracer.ClearScene();
-				previewer.SendObjectsToPathTracer(&pathTracer);
-				previewer.SetPathTracerCamera(&pathTracer);
+				// Camera and material restarts keep the loaded geometry, textures and BVH
+				if (init || stop || change == SceneChange::SCENE)
+				{
+					// Later camera edits are compared against the camera sent here
+					{
+						std::lock_guard<std::mutex> lock(renderMutex);
+						SyncPendingCamera();
+						cameraPending = false;
+					}
+					pathTracer.ClearScene();
+					previewer.SendObjectsToPathTracer(&pathTracer);
+					previewer.SetPathTracerCamera(&pathTracer);
+					pathTracer.SetEnvironmentMap(envMapFile);
+				}
+				else
+				{
+					for (auto& edit : materialEdits)
+						edit();
+				}
+				pathTracer.SetEnvironmentIntensity(envIntensity);
 
-				restart = false;
 				stop = false;
 				pathTracer.SetResolution(glm::ivec2(wRender, hRender));
 				pathTracer.SetTraceDepth(traceDepth);
-				pathTracer.SetOutImage(texData);
+				pathTracer.SetRouletteDepth(rouletteDepth);
+				pathTracer.SetAdaptiveSampling(adaptiveSampling);
+				pathTracer.SetAdaptiveThreshold(adaptiveThreshold);
+				pathTracer.SetDenoise(denoise);
+				pathTracer.SetLightGroups(lightGroups);
+				pathTracer.SetPackMaterialMaps(packMaterialMaps);
+				pathTracer.SetNumThreads(renderThreads);
+				pathTracer.SetReservedThreads(reservedThreads);
+				pathTracer.SetSamplesPerPass(samplesPerPass);
+				pathTracer.SetNavigationFrameTime(navigationFrameTime);
 				pathTracer.ResetImage();
 
 				glfwSetTime(0.0); // reset counter
 
 				init = false;
 			}
-			pathTracer.RenderFrame();
+			// Camera navigation renders low resolution frames until the camera rests
+			if (pathTracer.GetNavigating() && !navigating)
+				glfwSetTime(0.0); // accumulation starts over
+			pathTracer.SetNavigating(navigating);
+
+			// Don't overshoot the target sample count with the last batch
+			if (targetSample > pathTracer.GetSamples())
+				pathTracer.SetSamplesPerPass(glm::min(samplesPerPass, targetSample - pathTracer.GetSamples()));
+			else
+				pathTracer.SetSamplesPerPass(samplesPerPass);
+			passDone = pathTracer.RenderFrame(renderSliceMillis);
+		}
+		else
+		{
+			// Hand the display the end of the last pass and any display setting changes
+			pathTracer.UpdateFrame();
 		}
 		if (pause)
 		{
@@ -3609,19 +4120,31 @@ void PathTracerLoop()
 			execAfterSave = true;
 		}
 
-		if (render && pathTracer.GetSamples() == targetSample)
+		// A target of 0 renders until stopped, slices ending mid pass leave the count as it was
+		if (render && passDone && targetSample > 0 && pathTracer.GetSamples() == targetSample)
 		{
 			render = false;
 			pause = true;
+			continue;
+		}
+
+		// Sleep until the next command while there is nothing to render
+		if (!render)
+		{
+			std::unique_lock<std::mutex> lock(renderMutex);
+			if (!renderCommand)
+			{
+				renderWake.wait(lock, [] { return renderCommand; });
+				wakeLatency = std::chrono::duration<float, std::milli>(
+					std::chrono::steady_clock::now() - renderCommandTime).count();
+			}
+			renderCommand = false;
 		}
 	}
 }
 
 void OnExit()
 {
-	if (texData)
-		delete[] texData;
-
 	if (quadVao != -1)
 		glDeleteVertexArrays(1, &quadVao);
 	if (rbo != -1)
@@ -3669,6 +4192,7 @@ int main(int argc, char** argv)
 		{
 			GlfwLoop();
 			pathTracer.Exit();
+			WakePathTracer();
 		}
 		#pragma omp section
 		{
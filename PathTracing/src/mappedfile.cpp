@@ -0,0 +1,74 @@
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "pathutil.h"
+#include "mappedfile.h"
+
+MappedFile::MappedFile(const std::string& filename) :
+	mData(0),
+	mSize(0)
+{
+	std::string path = PathUtil::NativePath(filename);
+#if defined(_WIN32)
+	mMapping = 0;
+	mFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (mFile == INVALID_HANDLE_VALUE)
+		return;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(mFile, &size) || size.QuadPart == 0)
+		return;
+	mMapping = CreateFileMappingA(mFile, 0, PAGE_READONLY, 0, 0, 0);
+	if (!mMapping)
+		return;
+	mData = (const unsigned char*)MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+	if (mData)
+		mSize = (size_t)size.QuadPart;
+#else
+	mFile = open(path.c_str(), O_RDONLY);
+	if (mFile < 0)
+		return;
+	struct stat fileStat;
+	if (fstat(mFile, &fileStat) != 0 || fileStat.st_size == 0)
+		return;
+	void* data = mmap(0, (size_t)fileStat.st_size, PROT_READ, MAP_SHARED, mFile, 0);
+	if (data == MAP_FAILED)
+		return;
+	mData = (const unsigned char*)data;
+	mSize = (size_t)fileStat.st_size;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#if defined(_WIN32)
+	if (mData)
+		UnmapViewOfFile(mData);
+	if (mMapping)
+		CloseHandle(mMapping);
+	if (mFile != INVALID_HANDLE_VALUE)
+		CloseHandle(mFile);
+#else
+	if (mData)
+		munmap((void*)mData, mSize);
+	if (mFile >= 0)
+		close(mFile);
+#endif
+}
+
+const unsigned char* MappedFile::data() const
+{
+	return mData;
+}
+
+const size_t MappedFile::size() const
+{
+	return mSize;
+}
@@ -0,0 +1,32 @@
+#ifndef __MAPPEDFILE_H__
+#define __MAPPEDFILE_H__
+
+#include <string>
+
+// A whole file mapped read only into memory, its pages are read on first access
+class MappedFile
+{
+private:
+	const unsigned char* mData;
+	size_t mSize;
+#if defined(_WIN32)
+	void* mFile;
+	void* mMapping;
+#else
+	int mFile;
+#endif
+
+public:
+	MappedFile(const std::string& filename);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+public:
+	// Null if the file can't be mapped
+	const unsigned char* data() const;
+	const size_t size() const;
+};
+
+#endif
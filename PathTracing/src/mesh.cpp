@@ -77,6 +77,11 @@ void Triangle::Init()
 
 	normal = glm::cross(e1, e2);
 
+	float uvArea = fabs(deltaUv1.x * deltaUv2.y - deltaUv2.x * deltaUv1.y);
+	float worldArea = glm::length(normal);
+	if (uvArea > 0.0f && worldArea > 0.0f)
+		uvLod = 0.5f * log2f(uvArea / worldArea);
+
 	tangent = glm::normalize(tangent);
 	bitangent = glm::normalize(bitangent);
 	normal = glm::normalize(normal);
@@ -11,6 +11,8 @@
 
 const float EPS = 0.00001f;
 const float INF = (float)0xFFFF;
+// Number of light groups emissive materials can be tagged with
+const int MAX_LIGHT_GROUPS = 8;
 
 enum class MaterialType
 {
@@ -26,6 +28,7 @@ struct Material
 	glm::vec3 emissive;
 
 	float emissiveIntensity;
+	int lightGroup;
 	float roughness;
 	float reflectiveness;
 	float translucency;
@@ -37,10 +40,13 @@ struct Material
 	Image* roughnessTex;
 	Image* metallicTex;
 	Image* opacityTex;
+	// Opacity, roughness and metallic packed by the path tracer, read instead of those maps
+	Image* ormTex;
 
 	Material() :
 		type(MaterialType::OPAQUE),
 		emissiveIntensity(1.0f),
+		lightGroup(0),
 		roughness(1.0f),
 		reflectiveness(0.0f),
 		translucency(1.0f),
@@ -50,7 +56,8 @@ struct Material
 		emissTex(0),
 		roughnessTex(0),
 		metallicTex(0),
-		opacityTex(0)
+		opacityTex(0),
+		ormTex(0)
 	{
 		diffuse = glm::vec3(1.0f);
 		specular = glm::vec3(1.0f);
@@ -85,6 +92,8 @@ struct Triangle
 	glm::vec3 normal;
 	glm::vec3 tangent;
 	glm::vec3 bitangent;
+	// Half the log2 ratio of uv area to world area, the texture independent part of the LOD
+	float uvLod = 0.0f;
 
 	bool smoothing = false;
 
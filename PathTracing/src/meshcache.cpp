@@ -0,0 +1,55 @@
+#define TINYOBJLOADER_IMPLEMENTATION
+
+#include <map>
+#include <mutex>
+
+#include "pathutil.h"
+#include "meshcache.h"
+
+namespace MeshCache
+{
+	static std::mutex cacheMutex;
+	static std::map<std::string, std::weak_ptr<const Mesh>> cache;
+
+	std::shared_ptr<const Mesh> Load(const std::string& filename)
+	{
+		std::string key = PathUtil::UniversalPath(filename);
+		long long modifiedTime = 0, fileSize = 0;
+		if (!PathUtil::GetFileStamp(key, modifiedTime, fileSize))
+			return std::shared_ptr<const Mesh>();
+
+		{
+			std::lock_guard<std::mutex> lock(cacheMutex);
+			auto it = cache.find(key);
+			if (it != cache.end())
+			{
+				std::shared_ptr<const Mesh> mesh = it->second.lock();
+				if (mesh && mesh->modifiedTime == modifiedTime && mesh->fileSize == fileSize)
+					return mesh;
+				cache.erase(it);
+			}
+		}
+
+		// Parse without holding the lock, the other thread may look up other files meanwhile
+		std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>();
+		mesh->filename = filename;
+		mesh->modifiedTime = modifiedTime;
+		mesh->fileSize = fileSize;
+		std::vector<tinyobj::material_t> materials;
+		std::string warn, err;
+		if (!tinyobj::LoadObj(&mesh->attrib, &mesh->shapes, &materials, &warn, &err, filename.c_str()))
+			return std::shared_ptr<const Mesh>();
+
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		// Drop entries nobody holds anymore
+		for (auto it = cache.begin(); it != cache.end();)
+		{
+			if (it->second.expired())
+				it = cache.erase(it);
+			else
+				it++;
+		}
+		cache[key] = mesh;
+		return mesh;
+	}
+}
@@ -0,0 +1,28 @@
+#ifndef __MESHCACHE_H__
+#define __MESHCACHE_H__
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include <tiny_obj_loader.h>
+
+// Parsed OBJ files shared by the previewer and the path tracer. Entries are keyed by path
+// and validated against the file's modification time and size, a mesh stays cached for as
+// long as someone holds on to it.
+namespace MeshCache
+{
+	struct Mesh
+	{
+		std::string filename;
+		long long modifiedTime;
+		long long fileSize;
+		tinyobj::attrib_t attrib;
+		std::vector<tinyobj::shape_t> shapes;
+	};
+
+	// Returns null if the file can't be parsed
+	std::shared_ptr<const Mesh> Load(const std::string& filename);
+}
+
+#endif
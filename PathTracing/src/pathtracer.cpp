@@ -1,18 +1,56 @@
 #define _USE_MATH_DEFINES
 #include <sstream>
+#include <algorithm>
+#include <map>
+#include <tuple>
 #include <math.h>
 
 #include <omp.h>
 
 #include <tiny_obj_loader.h>
 
+#include "meshcache.h"
+#include "texturecache.h"
 #include "pathtracer.h"
 
+// Resolution of the per-light grid used to estimate and importance sample emissive textures
+const int LIGHT_TEXEL_GRID = 8;
+// Adaptive sampling: samples before a pixel may be considered converged,
+// and the most samples a noisy pixel may receive in a single pass
+const int ADAPTIVE_MIN_SAMPLES = 16;
+const int ADAPTIVE_MAX_SAMPLES_PER_PASS = 8;
+// Edge length of the screen tiles the render threads work on
+const int TILE_SIZE = 16;
+// Least time in seconds between two denoised frames published while rendering
+const float DENOISE_PUBLISH_INTERVAL = 0.5f;
+// Largest pixel block traced by a single ray while the camera is navigated
+const int NAVIGATION_MAX_SCALE = 8;
+// Ray cone spread added by a diffuse bounce, glossy bounces add it scaled by the roughness
+const float DIFFUSE_CONE_SPREAD = 0.5f * (float)M_PI;
+
 PathTracer::PathTracer() : mRng(std::random_device()())
 {
-	mOutImg = 0;
+	mBvh = 0;
+	mEnvMap = 0;
+	mEnvIntensity = 1.0f;
 	mTotalImg = 0;
+	mLumStatsImg = 0;
+	mPixelSamples = 0;
+	mPixelConverged = 0;
+	mAlbedoImg = 0;
+	mNormalImg = 0;
+	mDepthImg = 0;
+	mObjectIdImg = 0;
+	mElementIdImg = 0;
+	mDenoisedImg = 0;
 	mMaxDepth = 3;
+	mRouletteDepth = 3;
+	mEmissiveTexelImportance = true;
+	mLightsDirty = false;
+	mTexturesPending = false;
+	mPackMaterialMaps = false;
+	mNumLightGroups = 0;
+	mLightGroups = false;
 
 	mCamDir = glm::vec3(0.0f, 0.0f, 1.0f);
 	mCamUp = glm::vec3(0.0f, 1.0f, 0.0f);
@@ -22,30 +60,66 @@ PathTracer::PathTracer() : mRng(std::random_device()())
 	mCamAperture = 0.0f;
 
 	mSamples = 0;
+	mActivePixels = 0;
+	mAdaptiveSampling = false;
+	mAdaptiveThreshold = 0.01f;
+	mDenoise = false;
 	mNeedReset = false;
 	mExit = false;
+	mPassTilesLeft = 0;
+	mPassSamples = 0;
+	mPassSamplesPerPixel = 0;
+	mPassActivePixels = 0;
+	mNavigating = false;
+	mNavigationScale = 4;
+	mNavigationFrameTime = 33.0f;
+
+	mNumThreads = 0;
+	mReservedThreads = 3;
+	mSamplesPerPass = 1;
+	mImageVersion = 0;
+	mPublishedVersion = -1;
+	mFrameInvalid = false;
 }
 
 PathTracer::~PathTracer()
 {
 	if (mTotalImg)
 		delete[] mTotalImg;
+	if (mLumStatsImg)
+		delete[] mLumStatsImg;
+	if (mPixelSamples)
+		delete[] mPixelSamples;
+	if (mPixelConverged)
+		delete[] mPixelConverged;
+	if (mAlbedoImg)
+		delete[] mAlbedoImg;
+	if (mNormalImg)
+		delete[] mNormalImg;
+	if (mDepthImg)
+		delete[] mDepthImg;
+	if (mObjectIdImg)
+		delete[] mObjectIdImg;
+	if (mElementIdImg)
+		delete[] mElementIdImg;
+	if (mDenoisedImg)
+		delete[] mDenoisedImg;
 
 	if (mBvh)
 		delete mBvh;
 
-	for (auto texture : mLoadedTextures)
-		delete texture;
+	if (mEnvMap)
+		delete mEnvMap;
 }
 
 void PathTracer::LoadObject(const std::string& file, const glm::mat4& model)
 {
-	tinyobj::attrib_t attrib;
-	std::vector<tinyobj::shape_t> shapes;
-	std::vector<tinyobj::material_t> materials;
-	std::string warn, err;
-	if (tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, file.c_str()))
+	// Usually already parsed by the previewer
+	std::shared_ptr<const MeshCache::Mesh> mesh = MeshCache::Load(file);
+	if (mesh)
 	{
+		const tinyobj::attrib_t& attrib = mesh->attrib;
+		const std::vector<tinyobj::shape_t>& shapes = mesh->shapes;
 		int nameStartIndex = file.find_last_of('/') + 1;
 		if (nameStartIndex > file.size() - 1)
 			nameStartIndex = 0;
@@ -144,100 +218,123 @@ void PathTracer::LoadObject(const std::string& file, const glm::mat4& model)
 	}
 }
 
-void PathTracer::SetDiffuseTextureForElement(int objId, int elementId, const std::string& file)
+// Swaps the texture of a material slot, an empty file removes it. Images are shared through
+// the texture cache, so the slot drops its reference instead of reloading the image in place.
+void PathTracer::SetTexture(Image*& texture, const std::string& file, TextureFormat format)
 {
-	Material& mat = mLoadedObjects[objId].elements[elementId].material;
-	if (mat.diffuseTex)
+	if (texture)
 	{
-		auto it = std::find(mLoadedTextures.begin(), mLoadedTextures.end(), mat.diffuseTex);
-		(*it)->Load(file);
+		for (auto it = mLoadedTextures.begin(); it != mLoadedTextures.end(); it++)
+		{
+			if (it->get() == texture)
+			{
+				mLoadedTextures.erase(it);
+				break;
+			}
+		}
+		texture = 0;
 	}
-	else
+	if (file.size() != 0)
 	{
-		Image* texture = new Image(file);
-		mat.diffuseTex = texture;
-		mLoadedTextures.push_back(texture);
+		std::shared_ptr<Image> image = TextureCache::Request(file, format);
+		texture = image.get();
+		mLoadedTextures.push_back(image);
 	}
+	mTexturesPending = true;
+	mLightsDirty = true;
 }
 
-void PathTracer::SetNormalTextureForElement(int objId, int elementId, const std::string& file)
+void PathTracer::WaitForTextures()
 {
-	Material& mat = mLoadedObjects[objId].elements[elementId].material;
-	if (mat.normalTex)
-	{
-		auto it = std::find(mLoadedTextures.begin(), mLoadedTextures.end(), mat.normalTex);
-		(*it)->Load(file);
-	}
-	else
+	if (!mTexturesPending)
+		return;
+	for (auto& image : mLoadedTextures)
+		TextureCache::Wait(image);
+
+	// Files that couldn't be decoded leave the material untextured
+	for (auto& object : mLoadedObjects)
 	{
-		Image* texture = new Image(file);
-		mat.normalTex = texture;
-		mLoadedTextures.push_back(texture);
+		for (auto& element : object.elements)
+		{
+			Material& m = element.material;
+			Image** slots[] = { &m.diffuseTex, &m.normalTex, &m.emissTex, &m.roughnessTex, &m.metallicTex, &m.opacityTex };
+			for (auto slot : slots)
+			{
+				if (*slot && !(*slot)->data())
+					SetTexture(*slot, "");
+			}
+		}
 	}
+
+	PackMaterialMaps();
+	mTexturesPending = false;
 }
 
-void PathTracer::SetEmissTextureForElement(int objId, int elementId, const std::string& file)
+void PathTracer::PackMaterialMaps()
 {
-	Material& mat = mLoadedObjects[objId].elements[elementId].material;
-	if (mat.emissTex)
+	// Elements using the same maps share one packed image
+	std::map<std::tuple<Image*, Image*, Image*>, std::shared_ptr<Image>> packs;
+	for (auto& object : mLoadedObjects)
 	{
-		auto it = std::find(mLoadedTextures.begin(), mLoadedTextures.end(), mat.emissTex);
-		(*it)->Load(file);
+		for (auto& element : object.elements)
+		{
+			Material& m = element.material;
+			element.orm.reset();
+			m.ormTex = 0;
+			int numMaps = (m.opacityTex ? 1 : 0) + (m.roughnessTex ? 1 : 0) + (m.metallicTex ? 1 : 0);
+			// Packing paged maps would read every texel through the tile cache, they stay apart
+			bool paged = (m.opacityTex && m.opacityTex->paged()) || (m.roughnessTex && m.roughnessTex->paged()) ||
+				(m.metallicTex && m.metallicTex->paged());
+			if (mPackMaterialMaps && numMaps >= 2 && !paged)
+			{
+				std::shared_ptr<Image>& pack = packs[std::make_tuple(m.opacityTex, m.roughnessTex, m.metallicTex)];
+				if (!pack)
+					pack = std::make_shared<Image>();
+				element.orm = pack;
+				m.ormTex = pack.get();
+			}
+		}
 	}
-	else
+	if (packs.empty())
+		return;
+
+	std::vector<std::pair<std::tuple<Image*, Image*, Image*>, std::shared_ptr<Image>>> jobs(packs.begin(), packs.end());
+	mThreadPool.Resize(GetNumThreads());
+	mThreadPool.Run(jobs.size(), [&](int i, int)
 	{
-		Image* texture = new Image(file);
-		mat.emissTex = texture;
-		mLoadedTextures.push_back(texture);
-	}
+		const std::tuple<Image*, Image*, Image*>& maps = jobs[i].first;
+		jobs[i].second->Pack(std::get<0>(maps), std::get<1>(maps), std::get<2>(maps));
+	});
+}
+
+void PathTracer::SetDiffuseTextureForElement(int objId, int elementId, const std::string& file)
+{
+	SetTexture(mLoadedObjects[objId].elements[elementId].material.diffuseTex, file);
+}
+
+void PathTracer::SetNormalTextureForElement(int objId, int elementId, const std::string& file)
+{
+	SetTexture(mLoadedObjects[objId].elements[elementId].material.normalTex, file, TextureFormat::NORMAL_XY);
+}
+
+void PathTracer::SetEmissTextureForElement(int objId, int elementId, const std::string& file)
+{
+	SetTexture(mLoadedObjects[objId].elements[elementId].material.emissTex, file);
 }
 
 void PathTracer::SetRoughnessTextureForElement(int objId, int elementId, const std::string& file)
 {
-	Material& mat = mLoadedObjects[objId].elements[elementId].material;
-	if (mat.roughnessTex)
-	{
-		auto it = std::find(mLoadedTextures.begin(), mLoadedTextures.end(), mat.roughnessTex);
-		(*it)->Load(file);
-	}
-	else
-	{
-		Image* texture = new Image(file);
-		mat.roughnessTex = texture;
-		mLoadedTextures.push_back(texture);
-	}
+	SetTexture(mLoadedObjects[objId].elements[elementId].material.roughnessTex, file, TextureFormat::R);
 }
 
 void PathTracer::SetMetallicTextureForElement(int objId, int elementId, const std::string& file)
 {
-	Material& mat = mLoadedObjects[objId].elements[elementId].material;
-	if (mat.metallicTex)
-	{
-		auto it = std::find(mLoadedTextures.begin(), mLoadedTextures.end(), mat.metallicTex);
-		(*it)->Load(file);
-	}
-	else
-	{
-		Image* texture = new Image(file);
-		mat.metallicTex = texture;
-		mLoadedTextures.push_back(texture);
-	}
+	SetTexture(mLoadedObjects[objId].elements[elementId].material.metallicTex, file, TextureFormat::R);
 }
 
 void PathTracer::SetOpacityTextureForElement(int objId, int elementId, const std::string& file)
 {
-	Material& mat = mLoadedObjects[objId].elements[elementId].material;
-	if (mat.opacityTex)
-	{
-		auto it = std::find(mLoadedTextures.begin(), mLoadedTextures.end(), mat.opacityTex);
-		(*it)->Load(file);
-	}
-	else
-	{
-		Image* texture = new Image(file);
-		mat.opacityTex = texture;
-		mLoadedTextures.push_back(texture);
-	}
+	SetTexture(mLoadedObjects[objId].elements[elementId].material.opacityTex, file, TextureFormat::R);
 }
 
 void PathTracer::SetMaterial(int objId, int elementId, Material& material)
@@ -253,8 +350,36 @@ void PathTracer::SetMaterial(int objId, int elementId, Material& material)
 	material.roughnessTex = mLoadedObjects[objId].elements[elementId].material.roughnessTex;
 	material.metallicTex = mLoadedObjects[objId].elements[elementId].material.metallicTex;
 	material.opacityTex = mLoadedObjects[objId].elements[elementId].material.opacityTex;
+	material.ormTex = mLoadedObjects[objId].elements[elementId].material.ormTex;
 
 	mLoadedObjects[objId].elements[elementId].material = material;
+	mLightsDirty = true;
+}
+
+void PathTracer::SetEnvironmentMap(const std::string& file)
+{
+	if (mEnvMap)
+		delete mEnvMap;
+	mEnvMap = 0;
+	if (file.size() == 0)
+		return;
+
+	mEnvMap = new EnvironmentMap(file);
+	if (!mEnvMap->data())
+	{
+		delete mEnvMap;
+		mEnvMap = 0;
+	}
+}
+
+const float PathTracer::GetEnvironmentIntensity() const
+{
+	return mEnvIntensity;
+}
+
+void PathTracer::SetEnvironmentIntensity(float intensity)
+{
+	mEnvIntensity = glm::max(intensity, 0.0f);
 }
 
 void PathTracer::BuildBVH()
@@ -264,13 +389,99 @@ void PathTracer::BuildBVH()
 	mBvh = new BVHNode();
 	mBvh->Construct(mTriangles, mTriangles.size());
 
+	BuildLights();
+}
+
+void PathTracer::BuildLights()
+{
+	WaitForTextures();
 	std::vector<Triangle*>().swap(mLights);
 	for (auto& t : mTriangles)
 	{
 		t.mat = &mLoadedObjects[t.objectId].elements[t.elementId].material;
-		if (glm::length(t.mat->emissive) >= EPS)
+		if (glm::length(t.mat->emissive) >= EPS || t.mat->emissTex)
 			mLights.push_back(&t);
 	}
+
+	BuildLightDistribution();
+	mLightsDirty = false;
+}
+
+void PathTracer::BuildLightDistribution()
+{
+	std::vector<float>().swap(mLightCdf);
+	std::vector<std::vector<float>>().swap(mLightTexelCdf);
+	mNumLightGroups = 0;
+	if (mLights.size() == 0)
+		return;
+
+	for (auto light : mLights)
+		mNumLightGroups = glm::max(mNumLightGroups, LightGroup(*light->mat) + 1);
+
+	const int cells = LIGHT_TEXEL_GRID * LIGHT_TEXEL_GRID;
+	const glm::vec3 lumWeights = glm::vec3(0.2126f, 0.7152f, 0.0722f);
+
+	std::vector<float> power(mLights.size(), 0.0f);
+	mLightTexelCdf.resize(mLights.size());
+	float totalPower = 0.0f;
+	for (int i = 0; i < (int)mLights.size(); i++)
+	{
+		Triangle* t = mLights[i];
+		float area = 0.5f * glm::length(glm::cross(t->v2 - t->v1, t->v3 - t->v1));
+		float radiance = 0.0f;
+		if (t->mat->emissTex)
+		{
+			// Average the texture over its footprint on the triangle, 2x2 taps per grid cell
+			std::vector<float> cellLum(cells, 0.0f);
+			for (int y = 0; y < LIGHT_TEXEL_GRID; y++)
+			{
+				for (int x = 0; x < LIGHT_TEXEL_GRID; x++)
+				{
+					float lum = 0.0f;
+					for (int s = 0; s < 4; s++)
+					{
+						float r1 = (x + 0.25f + 0.5f * (s & 1)) / LIGHT_TEXEL_GRID;
+						float r2 = (y + 0.25f + 0.5f * (s >> 1)) / LIGHT_TEXEL_GRID;
+						lum += glm::dot(GetEmission(SampleTriangleBarycentric(r1, r2), t), lumWeights);
+					}
+					cellLum[y * LIGHT_TEXEL_GRID + x] = lum * 0.25f;
+					radiance += lum * 0.25f;
+				}
+			}
+			radiance /= (float)cells;
+
+			if (mEmissiveTexelImportance && radiance > 0.0f)
+			{
+				// Keep a uniform floor so texels missed by the estimate can still be sampled
+				std::vector<float>& cdf = mLightTexelCdf[i];
+				cdf.resize(cells);
+				float sum = 0.0f;
+				for (int k = 0; k < cells; k++)
+				{
+					sum += 0.9f * cellLum[k] / (radiance * cells) + 0.1f / cells;
+					cdf[k] = sum;
+				}
+				cdf.back() = 1.0f;
+			}
+		}
+		else
+			radiance = glm::dot(GetEmission(glm::vec2(0.0f), t), lumWeights);
+
+		power[i] = glm::max(area * radiance, 0.0f);
+		totalPower += power[i];
+	}
+
+	mLightCdf.resize(mLights.size());
+	float sum = 0.0f;
+	for (int i = 0; i < (int)mLights.size(); i++)
+	{
+		if (totalPower > 0.0f)
+			sum += 0.9f * power[i] / totalPower + 0.1f / mLights.size();
+		else
+			sum += 1.0f / mLights.size();
+		mLightCdf[i] = sum;
+	}
+	mLightCdf.back() = 1.0f;
 }
 
 void PathTracer::ResetImage()
@@ -285,24 +496,83 @@ void PathTracer::ClearScene()
 	if (mBvh)
 		delete mBvh;
 	mBvh = 0;
-	for (auto texture : mLoadedTextures)
-		delete texture;
-	mLoadedTextures.swap(std::vector<Image*>());
+	std::vector<std::shared_ptr<Image>>().swap(mLoadedTextures);
+	if (mEnvMap)
+		delete mEnvMap;
+	mEnvMap = 0;
 
+	std::lock_guard<std::mutex> lock(mResolveMutex);
 	if (mTotalImg)
 		delete[] mTotalImg;
 	mTotalImg = 0;
-}
-
-void PathTracer::SetOutImage(GLubyte* out)
-{
-	mOutImg = out;
+	if (mLumStatsImg)
+		delete[] mLumStatsImg;
+	mLumStatsImg = 0;
+	if (mPixelSamples)
+		delete[] mPixelSamples;
+	mPixelSamples = 0;
+	if (mPixelConverged)
+		delete[] mPixelConverged;
+	mPixelConverged = 0;
+	if (mAlbedoImg)
+		delete[] mAlbedoImg;
+	mAlbedoImg = 0;
+	if (mNormalImg)
+		delete[] mNormalImg;
+	mNormalImg = 0;
+	if (mDepthImg)
+		delete[] mDepthImg;
+	mDepthImg = 0;
+	if (mObjectIdImg)
+		delete[] mObjectIdImg;
+	mObjectIdImg = 0;
+	if (mElementIdImg)
+		delete[] mElementIdImg;
+	mElementIdImg = 0;
+	if (mDenoisedImg)
+		delete[] mDenoisedImg;
+	mDenoisedImg = 0;
+	std::vector<float>().swap(mLightGroupImg);
 }
 
 void PathTracer::SetResolution(const glm::ivec2& res)
 {
+	std::lock_guard<std::mutex> lock(mResolveMutex);
+	// Restarts that keep the scene also keep the image buffers
+	if (res == mResolution && mTotalImg)
+		return;
 	mResolution = res;
+	if (mTotalImg)
+		delete[] mTotalImg;
 	mTotalImg = new float[res.x * res.y * 3];
+	if (mLumStatsImg)
+		delete[] mLumStatsImg;
+	mLumStatsImg = new float[res.x * res.y * 2];
+	if (mPixelSamples)
+		delete[] mPixelSamples;
+	mPixelSamples = new int[res.x * res.y];
+	if (mPixelConverged)
+		delete[] mPixelConverged;
+	mPixelConverged = new bool[res.x * res.y];
+	if (mAlbedoImg)
+		delete[] mAlbedoImg;
+	mAlbedoImg = new float[res.x * res.y * 3];
+	if (mNormalImg)
+		delete[] mNormalImg;
+	mNormalImg = new float[res.x * res.y * 3];
+	if (mDepthImg)
+		delete[] mDepthImg;
+	mDepthImg = new float[res.x * res.y];
+	if (mObjectIdImg)
+		delete[] mObjectIdImg;
+	mObjectIdImg = new int[res.x * res.y];
+	if (mElementIdImg)
+		delete[] mElementIdImg;
+	mElementIdImg = new int[res.x * res.y];
+	if (mDenoisedImg)
+		delete[] mDenoisedImg;
+	mDenoisedImg = new float[res.x * res.y * 3];
+	BuildTiles();
 }
 
 std::vector<PathTracerLoader::Object> PathTracer::GetLoadedObjects() const
@@ -330,6 +600,170 @@ void PathTracer::SetTraceDepth(int depth)
 	mMaxDepth = depth;
 }
 
+const int PathTracer::GetRouletteDepth() const
+{
+	return mRouletteDepth;
+}
+
+void PathTracer::SetRouletteDepth(int depth)
+{
+	mRouletteDepth = glm::max(depth, 0);
+}
+
+const bool PathTracer::GetEmissiveTexelImportance() const
+{
+	return mEmissiveTexelImportance;
+}
+
+void PathTracer::SetEmissiveTexelImportance(bool enable)
+{
+	mEmissiveTexelImportance = enable;
+}
+
+const bool PathTracer::GetAdaptiveSampling() const
+{
+	return mAdaptiveSampling;
+}
+
+void PathTracer::SetAdaptiveSampling(bool enable)
+{
+	mAdaptiveSampling = enable;
+}
+
+const float PathTracer::GetAdaptiveThreshold() const
+{
+	return mAdaptiveThreshold;
+}
+
+void PathTracer::SetAdaptiveThreshold(float threshold)
+{
+	mAdaptiveThreshold = glm::max(threshold, 0.0f);
+}
+
+const int PathTracer::GetNumThreads() const
+{
+	if (mNumThreads > 0)
+		return mNumThreads;
+	// Leave some cores to the UI thread
+	return glm::max(omp_get_max_threads() - mReservedThreads, 1);
+}
+
+void PathTracer::SetNumThreads(int numThreads)
+{
+	mNumThreads = glm::max(numThreads, 0);
+}
+
+const int PathTracer::GetReservedThreads() const
+{
+	return mReservedThreads;
+}
+
+void PathTracer::SetReservedThreads(int reserved)
+{
+	mReservedThreads = glm::max(reserved, 0);
+}
+
+const int PathTracer::GetSamplesPerPass() const
+{
+	return mSamplesPerPass;
+}
+
+void PathTracer::SetSamplesPerPass(int samples)
+{
+	mSamplesPerPass = glm::max(samples, 1);
+}
+
+const int PathTracer::GetImageVersion() const
+{
+	return mImageVersion;
+}
+
+const TonemapOperator PathTracer::GetTonemapOperator() const
+{
+	return mTonemapper.GetOperator();
+}
+
+void PathTracer::SetTonemapOperator(TonemapOperator op)
+{
+	std::lock_guard<std::mutex> lock(mResolveMutex);
+	mTonemapper.SetOperator(op);
+}
+
+const bool PathTracer::GetSrgbOutput() const
+{
+	return mTonemapper.GetSrgb();
+}
+
+void PathTracer::SetSrgbOutput(bool srgb)
+{
+	std::lock_guard<std::mutex> lock(mResolveMutex);
+	mTonemapper.SetSrgb(srgb);
+}
+
+const bool PathTracer::GetDenoise() const
+{
+	return mDenoise;
+}
+
+void PathTracer::SetDenoise(bool enable)
+{
+	mDenoise = enable;
+}
+
+const bool PathTracer::GetLightGroups() const
+{
+	return mLightGroups;
+}
+
+void PathTracer::SetLightGroups(bool enable)
+{
+	mLightGroups = enable;
+}
+
+const bool PathTracer::GetPackMaterialMaps() const
+{
+	return mPackMaterialMaps;
+}
+
+void PathTracer::SetPackMaterialMaps(bool enable)
+{
+	if (mPackMaterialMaps == enable)
+		return;
+	mPackMaterialMaps = enable;
+	mTexturesPending = true;
+}
+
+const int PathTracer::GetLightGroupCount() const
+{
+	// Emissive groups followed by the environment
+	return mNumLightGroups + 1;
+}
+
+const bool PathTracer::GetNavigating() const
+{
+	return mNavigating;
+}
+
+void PathTracer::SetNavigating(bool navigating)
+{
+	mNavigating = navigating;
+}
+
+const int PathTracer::GetNavigationScale() const
+{
+	return mNavigationScale;
+}
+
+const float PathTracer::GetNavigationFrameTime() const
+{
+	return mNavigationFrameTime;
+}
+
+void PathTracer::SetNavigationFrameTime(float millis)
+{
+	mNavigationFrameTime = glm::max(millis, 1.0f);
+}
+
 void PathTracer::SetCamera(const glm::vec3& pos, const glm::vec3& dir, const glm::vec3& up)
 {
 	mCamPos = pos;
@@ -370,6 +804,35 @@ const float PathTracer::Rand()
 	return dis(mRng);
 }
 
+void PathTracer::BuildTiles()
+{
+	std::vector<std::pair<unsigned int, glm::ivec4>> tiles;
+	for (int y = 0; y < mResolution.y; y += TILE_SIZE)
+	{
+		for (int x = 0; x < mResolution.x; x += TILE_SIZE)
+		{
+			// Interleave the tile coordinate bits so that consecutive tiles stay close on screen
+			unsigned int code = 0;
+			unsigned int tx = x / TILE_SIZE, ty = y / TILE_SIZE;
+			for (int b = 0; b < 16; b++)
+				code |= ((tx >> b) & 1u) << (2 * b) | ((ty >> b) & 1u) << (2 * b + 1);
+			glm::ivec4 bounds(x, y, glm::min(x + TILE_SIZE, mResolution.x), glm::min(y + TILE_SIZE, mResolution.y));
+			tiles.push_back(std::make_pair(code, bounds));
+		}
+	}
+	std::sort(tiles.begin(), tiles.end(),
+		[](const std::pair<unsigned int, glm::ivec4>& a, const std::pair<unsigned int, glm::ivec4>& b)
+		{
+			return a.first < b.first;
+		});
+
+	mTiles.resize(tiles.size());
+	for (size_t i = 0; i < tiles.size(); i++)
+		mTiles[i] = tiles[i].second;
+	// A pass in flight was laid out for the old tiles
+	mPassTilesLeft = 0;
+}
+
 const glm::vec3 PathTracer::IntersectTriangle
 (
 	const glm::vec3& ro, const glm::vec3& rd,
@@ -471,7 +934,8 @@ const bool PathTracer::Hit
 			{
 				glm::vec2 c = glm::vec2(test.y, test.z);
 				glm::vec2 uv = GetUV(c, node->mTriangle);
-				float opacity = node->mTriangle->mat->opacityTex->tex2D(uv).r;
+				Image* ormTex = node->mTriangle->mat->ormTex;
+				float opacity = ormTex ? ormTex->tex2D(uv).r : node->mTriangle->mat->opacityTex->tex2D(uv).r;
 				result = Rand() < opacity;
 			}
 
@@ -501,17 +965,70 @@ const glm::vec3 PathTracer::SampleTriangle(const glm::vec3& v0, const glm::vec3&
 	return w0 * v0 + w1 * v1 + w2 * v2;
 }
 
-const glm::vec3 PathTracer::DirectIllumimation(const glm::vec3& rd, const glm::vec3& p, const glm::vec3& n, const glm::vec3& diffuse)
+const glm::vec2 PathTracer::SampleTriangleBarycentric(float r1, float r2) const
 {
-	if (mLights.size() == 0)
+	float u = sqrt(r1);
+	return glm::vec2(u * (1.f - r2), u * r2);
+}
+
+const glm::vec3 PathTracer::GetEmission(const glm::vec2& c, Triangle* t) const
+{
+	glm::vec3 emiss = t->mat->emissive;
+	if (t->mat->emissTex)
+		emiss = glm::vec3(t->mat->emissTex->tex2D(GetUV(c, t)));
+	return emiss * t->mat->emissiveIntensity;
+}
+
+const int PathTracer::LightGroup(const Material& mat) const
+{
+	return glm::clamp(mat.lightGroup, 0, MAX_LIGHT_GROUPS - 1);
+}
+
+const glm::vec3 PathTracer::DirectIllumimation
+(
+	const glm::vec3& rd, const glm::vec3& p, const glm::vec3& n, const glm::vec3& diffuse,
+	int* lightGroupOut
+)
+{
+	if (mLights.size() == 0 && !mEnvMap)
 		return glm::vec3(0.f);
-	// sample a light triangle
-	int lightId = int(floor(Rand() * mLights.size()));
-	if (lightId == mLights.size() && lightId > 0)
-		lightId--;
+	// split light samples evenly between the environment and the light triangles
+	float weight = 1.0f;
+	if (mEnvMap)
+	{
+		if (lightGroupOut)
+			*lightGroupOut = mNumLightGroups;
+		if (mLights.size() == 0)
+			return EnvironmentIllumination(p, n, diffuse);
+		if (Rand() < 0.5f)
+			return EnvironmentIllumination(p, n, diffuse) * 2.0f;
+		weight = 2.0f;
+	}
+	// sample a light triangle proportional to its estimated power
+	int lightId = std::upper_bound(mLightCdf.begin(), mLightCdf.end(), Rand()) - mLightCdf.begin();
+	if (lightId >= (int)mLights.size())
+		lightId = mLights.size() - 1;
+	float lightPdf = mLightCdf[lightId] - (lightId > 0 ? mLightCdf[lightId - 1] : 0.0f);
+	weight /= lightPdf;
 	Triangle* tLight = mLights[lightId];
-	// sample a point inside the triangle
-	glm::vec3 vLight = SampleTriangle(tLight->v1, tLight->v2, tLight->v3);
+	if (lightGroupOut)
+		*lightGroupOut = LightGroup(*tLight->mat);
+	// sample a point inside the triangle, by emissive texel importance if available
+	float r1 = Rand();
+	float r2 = Rand();
+	const std::vector<float>& texelCdf = mLightTexelCdf[lightId];
+	if (!texelCdf.empty())
+	{
+		int cell = std::upper_bound(texelCdf.begin(), texelCdf.end(), Rand()) - texelCdf.begin();
+		if (cell >= (int)texelCdf.size())
+			cell = texelCdf.size() - 1;
+		float cellPdf = texelCdf[cell] - (cell > 0 ? texelCdf[cell - 1] : 0.0f);
+		weight /= cellPdf * texelCdf.size();
+		r1 = (cell % LIGHT_TEXEL_GRID + r1) / LIGHT_TEXEL_GRID;
+		r2 = (cell / LIGHT_TEXEL_GRID + r2) / LIGHT_TEXEL_GRID;
+	}
+	glm::vec2 cLight = SampleTriangleBarycentric(r1, r2);
+	glm::vec3 vLight = (1.0f - cLight.x - cLight.y) * tLight->v1 + cLight.x * tLight->v2 + cLight.y * tLight->v3;
 	// evaluate the shadow ray
 	glm::vec3 l = glm::normalize(vLight - p);
 	if (glm::dot(-n, -l) <= 0.f)
@@ -525,9 +1042,40 @@ const glm::vec3 PathTracer::DirectIllumimation(const glm::vec3& rd, const glm::v
 			return glm::vec3(0.f);
 	}
 
-	glm::vec3 lColor = tLight->mat->emissive * tLight->mat->emissiveIntensity;
+	glm::vec3 lColor = GetEmission(cLight, tLight) * weight;
+
+	// Same convention as the environment, the Lambertian estimate L * albedo * cos / (pi * pdf),
+	// the point's solid angle pdf being d^2 / (area * cosLight). Emitters light both sides.
+	glm::vec3 edgeCross = glm::cross(tLight->v2 - tLight->v1, tLight->v3 - tLight->v1);
+	float doubleArea = glm::length(edgeCross);
+	if (doubleArea <= 0.0f)
+		return glm::vec3(0.f);
+	float cosLight = fabs(glm::dot(edgeCross, l)) / doubleArea;
+	float dist2 = glm::dot(vLight - p, vLight - p);
+	float geometry = 0.5f * doubleArea * cosLight / glm::max(dist2, EPS);
+
+	return lColor * diffuse * glm::dot(-n, -l) * geometry / float(M_PI);
+}
+
+const glm::vec3 PathTracer::EnvironmentIllumination(const glm::vec3& p, const glm::vec3& n, const glm::vec3& diffuse)
+{
+	// importance sample the environment by its luminance
+	glm::vec3 l;
+	float pdf = 0.0f;
+	glm::vec3 lColor = mEnvMap->Sample(Rand(), Rand(), l, pdf);
+	if (pdf <= 0.f)
+		return glm::vec3(0.f);
+	float cosTheta = glm::dot(n, l);
+	if (cosTheta <= 0.f)
+		return glm::vec3(0.f);
+	// evaluate the shadow ray
+	float d = 0.0;
+	Triangle* t = 0;
+	glm::vec2 c;
+	if (Hit(mBvh, p, l, t, d, c))
+		return glm::vec3(0.f);
 
-	return lColor * diffuse * glm::dot(-n, -l);
+	return lColor * mEnvIntensity * diffuse * cosTheta / (float(M_PI) * pdf);
 }
 
 const glm::vec2 PathTracer::GetUV(const glm::vec2& c, Triangle* t) const
@@ -542,7 +1090,31 @@ const glm::vec3 PathTracer::GetSmoothNormal(const glm::vec2& c, Triangle* t) con
 	return glm::normalize(n);
 }
 
-const glm::vec3 PathTracer::Trace(const glm::vec3& ro, const glm::vec3& rd, int depth, int iter, bool inside)
+const glm::vec3 PathTracer::TraceBounce
+(
+	const glm::vec3& ro, const glm::vec3& rd, const glm::vec3& weight,
+	const glm::vec3& throughput, int depth, int iter, bool inside, bool sampledLights,
+	glm::vec3* lightGroups, const RayCone& cone
+)
+{
+	glm::vec3 pathThroughput = throughput * weight;
+	// Russian Roulette Path Termination on the accumulated throughput
+	float survival = 1.0f;
+	if (depth >= mRouletteDepth)
+	{
+		survival = glm::min(0.95f, glm::max(glm::max(pathThroughput.x, pathThroughput.y), pathThroughput.z));
+		if (Rand() >= survival)
+			return glm::vec3(0.0f);
+	}
+	return Trace(ro, rd, depth, iter, inside, pathThroughput / survival, sampledLights, 0, lightGroups, cone) * weight / survival;
+}
+
+const glm::vec3 PathTracer::Trace
+(
+	const glm::vec3& ro, const glm::vec3& rd, int depth, int iter, bool inside,
+	const glm::vec3& throughput, bool sampledLights, PrimaryHit* primary, glm::vec3* lightGroups,
+	const RayCone& cone
+)
 {
 	float d = 0.0f;
 	Triangle* t = 0;
@@ -552,13 +1124,26 @@ const glm::vec3 PathTracer::Trace(const glm::vec3& ro, const glm::vec3& rd, int
 		Material& mat = mLoadedObjects[t->objectId].elements[t->elementId].material;
 		glm::vec3 p = ro + rd * d;
 		glm::vec2 uv = GetUV(c, t);
+		// The cone footprint on the surface picks the MIP level of every texture fetch
+		RayCone hitCone(cone.width + cone.spread * d, cone.spread);
+		float coneLod = t->uvLod + log2f(fabs(hitCone.width)) -
+			log2f(glm::max(fabs(glm::dot(t->normal, rd)), EPS));
+		auto lod = [&](Image* tex)
+		{
+			return coneLod + 0.5f * log2f((float)(tex->width() * tex->height()));
+		};
+		auto fetch = [&](Image* tex)
+		{
+			return tex->tex2D(uv, lod(tex));
+		};
+
 		glm::vec3 n = t->normal;
 		if (t->smoothing)
 			n = GetSmoothNormal(c, t);
 		if (mat.normalTex)
 		{
 			glm::mat3 TBN = glm::mat3(t->tangent, t->bitangent, n);
-			glm::vec3 nt = glm::vec3(mat.normalTex->tex2D(uv)) * 2.0f - 1.0f;
+			glm::vec3 nt = mat.normalTex->normal2D(uv, lod(mat.normalTex));
 			if (nt.z <= 0.0f)
 				nt = glm::vec3(nt.x, nt.y, EPS);
 			nt = glm::normalize(nt);
@@ -568,30 +1153,51 @@ const glm::vec3 PathTracer::Trace(const glm::vec3& ro, const glm::vec3& rd, int
 			n = -n;
 		p += n * EPS;
 
+		if (primary)
+		{
+			primary->albedo = mat.diffuseTex ? glm::vec3(fetch(mat.diffuseTex)) : mat.diffuse;
+			primary->normal = n;
+			primary->depth = d;
+			primary->objectId = t->objectId;
+			primary->elementId = t->elementId;
+		}
+
 		if (iter < mMaxDepth)
 		{
 			glm::vec3 diffuse = mat.diffuse;
 			if (mat.diffuseTex)
-				diffuse = glm::vec3(mat.diffuseTex->tex2D(uv));
+				diffuse = glm::vec3(fetch(mat.diffuseTex));
 			glm::vec3 emiss = mat.emissive;
 			if (mat.emissTex)
-				emiss = glm::vec3(mat.emissTex->tex2D(uv));
+				emiss = glm::vec3(fetch(mat.emissTex));
+			// Light groups receive the emission weighted by the path throughput, every emitter
+			// is a light so its group is below mNumLightGroups
+			int group = LightGroup(mat);
+			if (lightGroups && group < mNumLightGroups)
+				lightGroups[group] += throughput * emiss * mat.emissiveIntensity;
 			float roughness = mat.roughness;
-			if (mat.roughnessTex)
-				roughness = mat.roughnessTex->tex2D(uv).r;
 			float reflectiveness = mat.reflectiveness;
-			if (mat.metallicTex)
-				reflectiveness = mat.metallicTex->tex2D(uv).r;
+			if (mat.ormTex)
+			{
+				glm::vec4 orm = fetch(mat.ormTex);
+				if (mat.roughnessTex)
+					roughness = orm.g;
+				if (mat.metallicTex)
+					reflectiveness = orm.b;
+			}
+			else
+			{
+				if (mat.roughnessTex)
+					roughness = fetch(mat.roughnessTex).r;
+				if (mat.metallicTex)
+					reflectiveness = fetch(mat.metallicTex).r;
+			}
+			// Wider lobes blur what the bounce sees, so its fetches may use coarser levels
+			RayCone diffuseCone(hitCone.width, hitCone.spread + DIFFUSE_CONE_SPREAD);
+			RayCone glossyCone(hitCone.width, hitCone.spread + roughness * DIFFUSE_CONE_SPREAD);
 
 			depth++;
 			iter++;
-			// Russian Roulette Path Termination
-			float prob = glm::min(0.95f, glm::max(glm::max(mat.diffuse.x, mat.diffuse.y), mat.diffuse.z));
-			if (depth >= mMaxDepth)
-			{
-				if (glm::abs(Rand()) > prob)
-					return glm::vec3(0.0f);
-			}
 
 			glm::vec3 r = glm::reflect(rd, n);
 			glm::vec3 reflectDir;
@@ -623,7 +1229,7 @@ const glm::vec3 PathTracer::Trace(const glm::vec3& ro, const glm::vec3& rd, int
 						reflectDir = glm::normalize(reflectDir);
 					}
 					iter--;
-					return emiss * mat.emissiveIntensity + Trace(p, reflectDir, depth, iter, inside) * mat.specular;
+					return emiss * mat.emissiveIntensity + TraceBounce(p, reflectDir, mat.specular, throughput, depth, iter, inside, false, lightGroups, glossyCone);
 				}
 				else
 				{
@@ -635,7 +1241,11 @@ const glm::vec3 PathTracer::Trace(const glm::vec3& ro, const glm::vec3& rd, int
 					reflectDir = w * cosf(2.0f * M_PI * theta) * u + w * sinf(2.0f * M_PI * theta) * v + sqrtf(1.0f - w * w) * n;
 					reflectDir = glm::normalize(reflectDir);
 
-					return emiss * mat.emissiveIntensity + DirectIllumimation(rd, p, n, diffuse) + Trace(p, reflectDir, depth, iter, inside) * diffuse;
+					int lightGroup = 0;
+					glm::vec3 direct = DirectIllumimation(rd, p, n, diffuse, &lightGroup);
+					if (lightGroups)
+						lightGroups[lightGroup] += throughput * direct;
+					return emiss * mat.emissiveIntensity + direct + TraceBounce(p, reflectDir, diffuse, throughput, depth, iter, inside, true, lightGroups, diffuseCone);
 				}
 			}
 			else
@@ -699,7 +1309,7 @@ const glm::vec3 PathTracer::Trace(const glm::vec3& ro, const glm::vec3& rd, int
 						reflectDir = glm::normalize(reflectDir);
 					}
 					iter--;
-					return emiss * mat.emissiveIntensity + Trace(p, reflectDir, depth, iter, inside) * mat.specular;
+					return emiss * mat.emissiveIntensity + TraceBounce(p, reflectDir, mat.specular, throughput, depth, iter, inside, false, lightGroups, glossyCone);
 				}
 				else
 				{
@@ -709,7 +1319,7 @@ const glm::vec3 PathTracer::Trace(const glm::vec3& ro, const glm::vec3& rd, int
 						p -= n * EPS * 2.0f;
 						inside = !inside;
 						iter--;
-						return emiss * mat.emissiveIntensity + Trace(p, reflectDir, depth, iter, inside) * diffuse;
+						return emiss * mat.emissiveIntensity + TraceBounce(p, reflectDir, diffuse, throughput, depth, iter, inside, false, lightGroups, glossyCone);
 					}
 					else
 					{
@@ -721,12 +1331,24 @@ const glm::vec3 PathTracer::Trace(const glm::vec3& ro, const glm::vec3& rd, int
 						reflectDir = w * cosf(2.0f * M_PI * theta) * u + w * sinf(2.0f * M_PI * theta) * v + sqrtf(1.0f - w * w) * n;
 						reflectDir = glm::normalize(reflectDir);
 
-						return emiss * mat.emissiveIntensity + DirectIllumimation(rd, p, n, diffuse) + Trace(p, reflectDir, depth, iter, inside) * diffuse;
+						int lightGroup = 0;
+						glm::vec3 direct = DirectIllumimation(rd, p, n, diffuse, &lightGroup);
+						if (lightGroups)
+							lightGroups[lightGroup] += throughput * direct;
+						return emiss * mat.emissiveIntensity + direct + TraceBounce(p, reflectDir, diffuse, throughput, depth, iter, inside, true, lightGroups, diffuseCone);
 					}
 				}
 			}
 		}
 	}
+	else if (mEnvMap && !sampledLights)
+	{
+		// the environment was already sampled at the previous vertex if it did direct lighting
+		glm::vec3 env = mEnvMap->Eval(rd) * mEnvIntensity;
+		if (lightGroups)
+			lightGroups[mNumLightGroups] += throughput * env;
+		return env;
+	}
 
 	return glm::vec3(0.0f);
 }
@@ -738,19 +1360,76 @@ const glm::vec2 PathTracer::SampleCircle()
 	return glm::vec2(cos(angle), sin(angle)) * radius;
 }
 
-void PathTracer::RenderFrame()
+const bool PathTracer::RenderFrame(int maxMillis)
 {
 	mExit = false;
+	std::chrono::steady_clock::time_point deadline =
+		std::chrono::steady_clock::now() + std::chrono::milliseconds(maxMillis);
+
+	// Textures set since the last frame have to be decoded before any ray can hit them
+	WaitForTextures();
+
+	if (mNavigating)
+	{
+		RenderNavigationFrame();
+		return true;
+	}
 
+	int numPixels = mResolution.x * mResolution.y;
 	if (mNeedReset)
 	{
-		for (int i = 0; i < mResolution.x * mResolution.y * 3; i++)
+		// Materials edited in place may have added, removed or changed emitters
+		if (mLightsDirty && mBvh)
+			BuildLights();
+		for (int i = 0; i < numPixels * 3; i++)
 			mTotalImg[i] = 0.0f;
+		for (int i = 0; i < numPixels * 2; i++)
+			mLumStatsImg[i] = 0.0f;
+		for (int i = 0; i < numPixels * 3; i++)
+		{
+			mAlbedoImg[i] = 0.0f;
+			mNormalImg[i] = 0.0f;
+		}
+		for (int i = 0; i < numPixels; i++)
+		{
+			mPixelSamples[i] = 0;
+			mPixelConverged[i] = false;
+			mDepthImg[i] = 0.0f;
+			mObjectIdImg[i] = -1;
+			mElementIdImg[i] = -1;
+		}
+		if (mLightGroups)
+			mLightGroupImg.assign(numPixels * 3 * (mNumLightGroups + 1), 0.0f);
+		else
+			std::vector<float>().swap(mLightGroupImg);
 		mNeedReset = false;
         mSamples = 0;
+		mActivePixels = numPixels;
+		mPassTilesLeft = 0;
+		mImageVersion++;
 	}
 
-	mSamples++;
+	if (mPassTilesLeft == 0)
+	{
+		// Every tile takes all the samples of the pass before moving on
+		mPassSamples = mSamplesPerPass;
+		mPassSamplesPerPixel = mSamplesPerPass;
+		// Adaptive sampling: the samples freed by converged pixels go to the noisy ones
+		if (mAdaptiveSampling && mActivePixels > 0)
+			mPassSamplesPerPixel *= glm::clamp(numPixels / mActivePixels, 1, ADAPTIVE_MAX_SAMPLES_PER_PASS);
+		mTileDone.assign(mTiles.size(), 0);
+		mPassTilesLeft = mTiles.size();
+		mPassActivePixels = 0;
+	}
+	// A resumed pass keeps the sample count it started with so every pixel gets the same weight
+	int samplesPerPixel = mPassSamplesPerPixel;
+	std::vector<int> pendingTiles;
+	for (int i = 0; i < (int)mTiles.size(); i++)
+	{
+		if (!mTileDone[i])
+			pendingTiles.push_back(i);
+	}
+	const glm::vec3 lumWeights = glm::vec3(0.2126f, 0.7152f, 0.0722f);
 
 	// Position world space image plane
 	glm::vec3 imgCenter = mCamPos + mCamDir * mCamFocal;
@@ -760,28 +1439,191 @@ void PathTracer::RenderFrame()
 	float deltaX = imgWidth / (float)mResolution.x;
 	float deltaY = imgHeight / (float)mResolution.y;
 	glm::vec3 camRight = glm::normalize(glm::cross(mCamUp, mCamDir));
+	// Camera rays start as cones one pixel wide in angle
+	RayCone pixelCone(0.0f, deltaY / mCamFocal);
 
 	// Starting at top left
 	glm::vec3 topLeft = imgCenter - camRight * (imgWidth * 0.5f);
 	topLeft += mCamUp * (imgHeight * 0.5f);
 
-	int numThreads = omp_get_max_threads();
-	if (numThreads > 2)
-		numThreads -= 3;
-	else if (numThreads > 1)
-		numThreads -= 2;
-	else if (numThreads > 0)
-		numThreads--;
-	// Loop through each pixel
-	#pragma omp parallel for num_threads(numThreads)
-	for (int i = 0; i < mResolution.y; i++)
+	// Light groups are only accumulated if they were enabled at the last reset
+	bool lightGroups = !mLightGroupImg.empty();
+
+	mThreadPool.Resize(GetNumThreads());
+	std::vector<int> activePixels(mThreadPool.GetNumThreads(), 0);
+	std::vector<int> tilesDone(mThreadPool.GetNumThreads(), 0);
+	// Render the tiles in Morton order, idle workers steal tiles from the busy ones
+	mThreadPool.Run(pendingTiles.size(), [&](int task, int worker)
 	{
+		// Cancellation and the time budget are checked between tiles, a started tile is always
+		// finished. Every worker takes at least one tile so a sliced pass still advances.
 		if (mExit)
-			break;
+			return;
+		if (maxMillis > 0 && tilesDone[worker] > 0 && std::chrono::steady_clock::now() >= deadline)
+			return;
 
-		glm::vec3 pixel = topLeft - mCamUp * ((float)i * deltaY);
-		for (int j = 0; j < mResolution.x; j++)
+		int tile = pendingTiles[task];
+		const glm::ivec4& bounds = mTiles[tile];
+		for (int i = bounds.y; i < bounds.w; i++)
 		{
+			glm::vec3 pixel = topLeft - mCamUp * ((float)i * deltaY) + camRight * ((float)bounds.x * deltaX);
+			for (int j = bounds.x; j < bounds.z; j++, pixel += camRight * deltaX)
+			{
+				int pixelId = (mResolution.y - 1 - i) * mResolution.x + j;
+				if (mAdaptiveSampling && mPixelConverged[pixelId])
+					continue;
+
+				// Accumulate the pixel locally and publish it together with its sample count
+				glm::vec3 color(0.0f);
+				glm::vec3 albedo(0.0f);
+				glm::vec3 normal(0.0f);
+				float depth = 0.0f;
+				float lumSum = 0.0f;
+				float lumSqSum = 0.0f;
+				glm::vec3 groupSums[MAX_LIGHT_GROUPS + 1];
+				for (int g = 0; g <= mNumLightGroups; g++)
+					groupSums[g] = glm::vec3(0.0f);
+				int objectId = mObjectIdImg[pixelId];
+				int elementId = mElementIdImg[pixelId];
+				for (int s = 0; s < samplesPerPixel; s++)
+				{
+					glm::vec3 rayDir = glm::normalize(pixel - mCamPos);
+					// DOF
+					glm::vec3 camPos = mCamPos;
+					glm::vec3 focalPoint = camPos + rayDir * mCamFocalDist;
+					glm::vec2 camPosOffset = SampleCircle() * mCamAperture;
+					camPos += camRight * camPosOffset.x + mCamUp * camPosOffset.y;
+					rayDir = glm::normalize(focalPoint - camPos);
+
+					PrimaryHit primary;
+					glm::vec3 groups[MAX_LIGHT_GROUPS + 1];
+					for (int g = 0; g <= mNumLightGroups; g++)
+						groups[g] = glm::vec3(0.0f);
+					glm::vec3 sample = Trace(camPos, rayDir, 0, 0, false, glm::vec3(1.0f), false, &primary,
+						lightGroups ? groups : 0, pixelCone);
+					color += sample;
+
+					// First-hit AOVs, ids are taken from the first sample that hits a surface
+					albedo += primary.albedo;
+					normal += primary.normal;
+					depth += primary.depth;
+					if (objectId < 0)
+					{
+						objectId = primary.objectId;
+						elementId = primary.elementId;
+					}
+
+					if (lightGroups)
+					{
+						for (int g = 0; g <= mNumLightGroups; g++)
+							groupSums[g] += groups[g];
+					}
+
+					// Track the displayed (clamped) luminance for the noise estimate
+					float lum = glm::dot(glm::clamp(sample, glm::vec3(0.0f), glm::vec3(1.0f)), lumWeights);
+					lumSum += lum;
+					lumSqSum += lum * lum;
+				}
+
+				int imgPixel = pixelId * 3;
+				mTotalImg[imgPixel] += color.r;
+				mTotalImg[imgPixel + 1] += color.g;
+				mTotalImg[imgPixel + 2] += color.b;
+				mAlbedoImg[imgPixel] += albedo.r;
+				mAlbedoImg[imgPixel + 1] += albedo.g;
+				mAlbedoImg[imgPixel + 2] += albedo.b;
+				mNormalImg[imgPixel] += normal.x;
+				mNormalImg[imgPixel + 1] += normal.y;
+				mNormalImg[imgPixel + 2] += normal.z;
+				mDepthImg[pixelId] += depth;
+				mObjectIdImg[pixelId] = objectId;
+				mElementIdImg[pixelId] = elementId;
+				if (lightGroups)
+				{
+					for (int g = 0; g <= mNumLightGroups; g++)
+					{
+						float* groupImg = &mLightGroupImg[(g * numPixels + pixelId) * 3];
+						groupImg[0] += groupSums[g].r;
+						groupImg[1] += groupSums[g].g;
+						groupImg[2] += groupSums[g].b;
+					}
+				}
+				mLumStatsImg[pixelId * 2] += lumSum;
+				mLumStatsImg[pixelId * 2 + 1] += lumSqSum;
+				mPixelSamples[pixelId] += samplesPerPixel;
+
+				if (mAdaptiveSampling && mPixelSamples[pixelId] >= ADAPTIVE_MIN_SAMPLES)
+				{
+					// Standard error of the mean relative to the pixel brightness
+					float n = (float)mPixelSamples[pixelId];
+					float mean = mLumStatsImg[pixelId * 2] / n;
+					float variance = glm::max(mLumStatsImg[pixelId * 2 + 1] / n - mean * mean, 0.0f);
+					float error = sqrtf(variance / n);
+					mPixelConverged[pixelId] = error <= mAdaptiveThreshold * glm::max(mean, 0.05f);
+				}
+				if (!mPixelConverged[pixelId])
+					activePixels[worker]++;
+			}
+		}
+		mTileDone[tile] = 1;
+		tilesDone[worker]++;
+	});
+	int numTilesDone = 0;
+	for (int w = 0; w < mThreadPool.GetNumThreads(); w++)
+	{
+		numTilesDone += tilesDone[w];
+		mPassActivePixels += activePixels[w];
+	}
+	mPassTilesLeft -= numTilesDone;
+	if (numTilesDone > 0)
+		mImageVersion++;
+
+	bool passDone = mPassTilesLeft == 0;
+	if (passDone)
+	{
+		mSamples += mPassSamples;
+		mActivePixels = mPassActivePixels;
+	}
+
+	// Published once the workers are done so no resolve reads a pixel while it is written,
+	// the slice length sets the display cadence
+	PublishProgress();
+	return passDone;
+}
+
+void PathTracer::RenderNavigationFrame()
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	// One ray through the center of every scale x scale block
+	int scale = mNavigationScale;
+	int lowWidth = (mResolution.x + scale - 1) / scale;
+	int lowHeight = (mResolution.y + scale - 1) / scale;
+	mNavigationImg.resize(lowWidth * lowHeight);
+
+	glm::vec3 imgCenter = mCamPos + mCamDir * mCamFocal;
+	float imgHeight = 2.0f * mCamFocal * tan((mCamFovy / 2.0f) * M_PI / 180.0f);
+	float aspect = (float)mResolution.x / (float)mResolution.y;
+	float imgWidth = imgHeight * aspect;
+	float deltaX = imgWidth / (float)mResolution.x;
+	float deltaY = imgHeight / (float)mResolution.y;
+	glm::vec3 camRight = glm::normalize(glm::cross(mCamUp, mCamDir));
+	glm::vec3 topLeft = imgCenter - camRight * (imgWidth * 0.5f);
+	topLeft += mCamUp * (imgHeight * 0.5f);
+	// A ray covers the whole block
+	RayCone blockCone(0.0f, deltaY * (float)scale / mCamFocal);
+
+	mThreadPool.Resize(GetNumThreads());
+	mThreadPool.Run(lowHeight, [&](int y, int)
+	{
+		if (mExit)
+			return;
+
+		int i = glm::min(y * scale + scale / 2, mResolution.y - 1);
+		for (int x = 0; x < lowWidth; x++)
+		{
+			int j = glm::min(x * scale + scale / 2, mResolution.x - 1);
+			glm::vec3 pixel = topLeft - mCamUp * ((float)i * deltaY) + camRight * ((float)j * deltaX);
 			glm::vec3 rayDir = glm::normalize(pixel - mCamPos);
 			// DOF
 			glm::vec3 camPos = mCamPos;
@@ -789,31 +1631,198 @@ void PathTracer::RenderFrame()
 			glm::vec2 camPosOffset = SampleCircle() * mCamAperture;
 			camPos += camRight * camPosOffset.x + mCamUp * camPosOffset.y;
 			rayDir = glm::normalize(focalPoint - camPos);
+			mNavigationImg[y * lowWidth + x] = Trace(camPos, rayDir, 0, 0, false, glm::vec3(1.0f), false, 0, 0, blockCone);
+		}
+	});
+
+	// Bilinear upsampling of the block centers, every pixel counts as a single sample
+	mThreadPool.Run(mResolution.y, [&](int i, int)
+	{
+		float v = glm::clamp(((float)i + 0.5f) / (float)scale - 0.5f, 0.0f, (float)(lowHeight - 1));
+		int y0 = (int)v;
+		int y1 = glm::min(y0 + 1, lowHeight - 1);
+		float fy = v - (float)y0;
+		for (int j = 0; j < mResolution.x; j++)
+		{
+			float u = glm::clamp(((float)j + 0.5f) / (float)scale - 0.5f, 0.0f, (float)(lowWidth - 1));
+			int x0 = (int)u;
+			int x1 = glm::min(x0 + 1, lowWidth - 1);
+			float fx = u - (float)x0;
+			glm::vec3 top = glm::mix(mNavigationImg[y0 * lowWidth + x0], mNavigationImg[y0 * lowWidth + x1], fx);
+			glm::vec3 bottom = glm::mix(mNavigationImg[y1 * lowWidth + x0], mNavigationImg[y1 * lowWidth + x1], fx);
+			glm::vec3 color = glm::mix(top, bottom, fy);
+
+			int pixelId = (mResolution.y - 1 - i) * mResolution.x + j;
+			mTotalImg[pixelId * 3] = color.r;
+			mTotalImg[pixelId * 3 + 1] = color.g;
+			mTotalImg[pixelId * 3 + 2] = color.b;
+			mPixelSamples[pixelId] = 1;
+		}
+	});
+
+	// Pick the block size whose ray count fits the frame time at the measured cost per ray
+	float elapsed = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	float millisPerRay = glm::max(elapsed / (float)(lowWidth * lowHeight), 1e-6f);
+	float numRays = mNavigationFrameTime / millisPerRay;
+	float numPixels = (float)(mResolution.x * mResolution.y);
+	mNavigationScale = glm::clamp((int)ceilf(sqrtf(numPixels / numRays)), 1, NAVIGATION_MAX_SCALE);
+
+	// Full resolution accumulation starts over once the camera rests
+	mNeedReset = true;
+	mSamples = 0;
+	mImageVersion++;
+	PublishProgress();
+}
+
+void PathTracer::PublishProgress()
+{
+	// Nobody took the last frame yet, don't spend time on another one
+	if (mFrames.HasPending())
+		return;
+	if (mDenoise && !mNavigating && std::chrono::duration<float>(std::chrono::steady_clock::now() - mPublishTime).count() <
+		DENOISE_PUBLISH_INTERVAL)
+		return;
+	UpdateFrame();
+}
+
+void PathTracer::UpdateFrame()
+{
+	int version = mImageVersion;
+	if (version == mPublishedVersion && !mFrameInvalid)
+		return;
+	mFrameInvalid = false;
+
+	Frame& frame = mFrames.GetBackFrame();
+	frame.resolution = mResolution;
+	frame.pixels.resize(mResolution.x * mResolution.y * 3);
+	// Navigation frames are not worth denoising, their AOVs are stale
+	if (!ResolveImage(frame.pixels.data(), mDenoise && !mNavigating))
+		return;
+	frame.version = version;
+	mFrames.Publish();
+	mPublishedVersion = version;
+	mPublishTime = std::chrono::steady_clock::now();
+}
+
+void PathTracer::InvalidateFrame()
+{
+	mFrameInvalid = true;
+}
 
-			glm::vec3 color = Trace(camPos, rayDir);
+const Frame* PathTracer::GetPublishedFrame() const
+{
+	return mFrames.GetPublishedFrame();
+}
+
+const bool PathTracer::AcquireFrame()
+{
+	return mFrames.Acquire();
+}
+
+const Frame& PathTracer::GetFrame() const
+{
+	return mFrames.GetFrontFrame();
+}
+
+const bool PathTracer::ResolveImage(GLubyte* out, bool denoise)
+{
+	// The display and the exporter may resolve from different threads
+	std::lock_guard<std::mutex> lock(mResolveMutex);
+	if (!mTotalImg || !out)
+		return false;
 
-			// Draw
-			int imgPixel = ((mResolution.y - 1 - i) * mResolution.x + j) * 3;
+	int numPixels = mResolution.x * mResolution.y;
+	int numThreads = GetNumThreads();
+	if (denoise)
+	{
+		mDenoiser.Denoise(mResolution, mPixelSamples, mTotalImg, mLumStatsImg,
+			mAlbedoImg, mNormalImg, mDepthImg, mDenoisedImg, numThreads);
+	}
 
-			mTotalImg[imgPixel] += color.r;
-			mTotalImg[imgPixel + 1] += color.g;
-			mTotalImg[imgPixel + 2] += color.b;
+	// The denoised image already holds per-pixel means
+	if (denoise)
+		mTonemapper.Resolve(numPixels, 0, mDenoisedImg, out, numThreads);
+	else
+		mTonemapper.Resolve(numPixels, mPixelSamples, mTotalImg, out, numThreads);
 
-			glm::vec3 res = glm::vec3
-			(
-				mTotalImg[imgPixel] / (float)mSamples,
-				mTotalImg[imgPixel + 1] / (float)mSamples,
-				mTotalImg[imgPixel + 2] / (float)mSamples
-			);
-			res = glm::clamp(res, glm::vec3(0.0f), glm::vec3(1.0f));
+	return true;
+}
 
-			mOutImg[imgPixel] = res.r * 255;
-			mOutImg[imgPixel + 1] = res.g * 255;
-			mOutImg[imgPixel + 2] = res.b * 255;
+// Writes 3 floats per pixel: mean albedo, normal mapped to [0, 1], mean hit distance,
+// a stable color per object/element id (black for background) or the sample count
+const bool PathTracer::ResolveAov(AovType aov, float* out)
+{
+	std::lock_guard<std::mutex> lock(mResolveMutex);
+	if (!mTotalImg || !out)
+		return false;
 
-			pixel += camRight * deltaX;
+	int numPixels = mResolution.x * mResolution.y;
+	#pragma omp parallel for num_threads(GetNumThreads())
+	for (int i = 0; i < numPixels; i++)
+	{
+		float n = (float)glm::max(mPixelSamples[i], 1);
+		glm::vec3 res(0.0f);
+		switch (aov)
+		{
+		case AovType::ALBEDO:
+			res = glm::vec3(mAlbedoImg[i * 3], mAlbedoImg[i * 3 + 1], mAlbedoImg[i * 3 + 2]) / n;
+			break;
+		case AovType::NORMAL:
+			res = glm::vec3(mNormalImg[i * 3], mNormalImg[i * 3 + 1], mNormalImg[i * 3 + 2]);
+			if (glm::length(res) > EPS)
+				res = glm::normalize(res) * 0.5f + 0.5f;
+			break;
+		case AovType::DEPTH:
+			res = glm::vec3(mDepthImg[i] / n);
+			break;
+		case AovType::OBJECT_ID:
+		case AovType::ELEMENT_ID:
+		{
+			int id = aov == AovType::OBJECT_ID ? mObjectIdImg[i] : (mObjectIdImg[i] << 16) + mElementIdImg[i];
+			if (mObjectIdImg[i] < 0)
+				break;
+			// Integer hash so neighbouring ids get distinct colors
+			unsigned int h = (unsigned int)id + 1;
+			h = ((h >> 16) ^ h) * 0x45d9f3bu;
+			h = ((h >> 16) ^ h) * 0x45d9f3bu;
+			h = (h >> 16) ^ h;
+			res = glm::vec3(h & 0xFF, (h >> 8) & 0xFF, (h >> 16) & 0xFF) / 255.0f;
+			break;
 		}
+		case AovType::SAMPLES:
+			res = glm::vec3((float)mPixelSamples[i]);
+			break;
+		}
+
+		out[i * 3] = res.r;
+		out[i * 3 + 1] = res.g;
+		out[i * 3 + 2] = res.b;
+	}
+
+	return true;
+}
+
+// Writes 3 floats per pixel: the mean radiance reaching the camera from one light group,
+// group GetLightGroupCount() - 1 is the environment
+const bool PathTracer::ResolveLightGroup(int group, float* out)
+{
+	std::lock_guard<std::mutex> lock(mResolveMutex);
+	int numPixels = mResolution.x * mResolution.y;
+	if (!out || group < 0 || group > mNumLightGroups ||
+		mLightGroupImg.size() != (size_t)numPixels * 3 * (mNumLightGroups + 1))
+		return false;
+
+	const float* groupImg = &mLightGroupImg[group * numPixels * 3];
+	#pragma omp parallel for num_threads(GetNumThreads())
+	for (int i = 0; i < numPixels; i++)
+	{
+		float n = (float)glm::max(mPixelSamples[i], 1);
+		out[i * 3] = groupImg[i * 3] / n;
+		out[i * 3 + 1] = groupImg[i * 3 + 1] / n;
+		out[i * 3 + 2] = groupImg[i * 3 + 2] / n;
 	}
+
+	return true;
 }
 
 void PathTracer::Exit()
@@ -4,11 +4,20 @@
 #include <string>
 #include <vector>
 #include <random>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <memory>
 
 #include <GL/glew.h>
 #include <glm/glm.hpp>
 
 #include "mesh.h"
+#include "envmap.h"
+#include "denoiser.h"
+#include "tonemapper.h"
+#include "triplebuffer.h"
+#include "threadpool.h"
 
 namespace PathTracerLoader
 {
@@ -16,6 +25,8 @@ namespace PathTracerLoader
 	{
 		std::string name;
 		Material material;
+		// Owns the material's ormTex
+		std::shared_ptr<Image> orm;
 
 		Element()
 		{
@@ -45,20 +56,89 @@ namespace PathTracerLoader
 	};
 }
 
+// Footprint of a path for texture LOD selection, a cone of the given width at the ray
+// origin that widens by spread per unit of distance (Akenine-Moller et al. ray cones)
+struct RayCone
+{
+	float width;
+	float spread;
+
+	RayCone(float width = 0.0f, float spread = 0.0f) :
+		width(width),
+		spread(spread)
+	{}
+};
+
+// Data of the first surface seen by a camera ray
+struct PrimaryHit
+{
+	glm::vec3 albedo;
+	glm::vec3 normal;
+	float depth;
+	int objectId;
+	int elementId;
+
+	PrimaryHit() :
+		albedo(0.0f),
+		normal(0.0f),
+		depth(0.0f),
+		objectId(-1),
+		elementId(-1)
+	{}
+};
+
+// Auxiliary output buffers accumulated alongside the beauty image
+enum class AovType
+{
+	ALBEDO,
+	NORMAL,
+	DEPTH,
+	OBJECT_ID,
+	ELEMENT_ID,
+	SAMPLES
+};
+
 class PathTracer
 {
 private:
 	std::vector<Triangle> mTriangles;
 	BVHNode* mBvh;
 	std::vector<Triangle*> mLights;
+	std::vector<float> mLightCdf;
+	std::vector<std::vector<float>> mLightTexelCdf;
+	bool mEmissiveTexelImportance;
+	int mNumLightGroups;
+	// Set by material and texture edits, the lights are rebuilt with the next image reset
+	bool mLightsDirty;
+	// Set by texture edits, the render blocks on the decodes before it starts
+	bool mTexturesPending;
+	bool mPackMaterialMaps;
 
 	std::vector<PathTracerLoader::Object> mLoadedObjects;
-	std::vector<Image*> mLoadedTextures;
+	// One reference per material slot using the image
+	std::vector<std::shared_ptr<Image>> mLoadedTextures;
+
+	EnvironmentMap* mEnvMap;
+	float mEnvIntensity;
 
 	glm::ivec2 mResolution;
-	GLubyte* mOutImg;
+	// Screen tiles as (x0, y0, x1, y1) from the top left, in Morton order
+	std::vector<glm::ivec4> mTiles;
 	float* mTotalImg;
+	float* mLumStatsImg;
+	int* mPixelSamples;
+	bool* mPixelConverged;
+	float* mAlbedoImg;
+	float* mNormalImg;
+	float* mDepthImg;
+	int* mObjectIdImg;
+	int* mElementIdImg;
+	float* mDenoisedImg;
+	// Per light group planes of summed rgb, the environment is the last group
+	std::vector<float> mLightGroupImg;
+	bool mLightGroups;
 	int mMaxDepth;
+	int mRouletteDepth;
 
 	glm::vec3 mCamPos;
 	glm::vec3 mCamDir;
@@ -69,8 +149,41 @@ private:
 	float mCamAperture;
 
 	int mSamples;
+	int mSamplesPerPass;
+	int mActivePixels;
+	bool mAdaptiveSampling;
+	float mAdaptiveThreshold;
+	Denoiser mDenoiser;
+	Tonemapper mTonemapper;
+	// Set from the UI thread, read by the render thread when it publishes
+	std::atomic<bool> mDenoise;
 	bool mNeedReset;
-	bool mExit;
+	std::atomic<bool> mExit;
+	// Pass in flight, a pass cut short by Exit or the time budget is picked up by the next RenderFrame
+	std::vector<char> mTileDone;
+	int mPassTilesLeft;
+	int mPassSamples;
+	int mPassSamplesPerPixel;
+	int mPassActivePixels;
+	// While the camera is navigated every RenderFrame draws one low resolution frame, the
+	// block size adapts so that a frame takes about mNavigationFrameTime
+	bool mNavigating;
+	int mNavigationScale;
+	float mNavigationFrameTime; // in millisecond
+	std::vector<glm::vec3> mNavigationImg;
+	// Bumped whenever a tile finished or the image was reset
+	std::atomic<int> mImageVersion;
+	std::mutex mResolveMutex;
+
+	// Resolved frames handed from the render thread to the display
+	TripleBuffer mFrames;
+	int mPublishedVersion;
+	std::atomic<bool> mFrameInvalid;
+	std::chrono::steady_clock::time_point mPublishTime;
+
+	ThreadPool mThreadPool;
+	int mNumThreads;
+	int mReservedThreads;
 
 	std::mt19937 mRng;
 
@@ -80,6 +193,9 @@ public:
 
 private:
 	const float Rand();
+	void BuildTiles();
+	void RenderNavigationFrame();
+	void PublishProgress();
 	const glm::vec3 IntersectTriangle
 	(
 		const glm::vec3& ro, const glm::vec3& rd,
@@ -91,11 +207,36 @@ private:
 		Triangle*& triangleOut, float& distOut, glm::vec2& cOut
 	);
 	const glm::vec3 SampleTriangle(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2);
-	const glm::vec3 DirectIllumimation(const glm::vec3& rd, const glm::vec3& p, const glm::vec3& n, const glm::vec3& diffuse);
+	const glm::vec2 SampleTriangleBarycentric(float r1, float r2) const;
+	const glm::vec3 GetEmission(const glm::vec2& c, Triangle* t) const;
+	void BuildLights();
+	void BuildLightDistribution();
+	void SetTexture(Image*& texture, const std::string& file, TextureFormat format = TextureFormat::RGBA);
+	void WaitForTextures();
+	void PackMaterialMaps();
+	// Group index the material's emission is accumulated in
+	const int LightGroup(const Material& mat) const;
+	const glm::vec3 DirectIllumimation
+	(
+		const glm::vec3& rd, const glm::vec3& p, const glm::vec3& n, const glm::vec3& diffuse,
+		int* lightGroupOut = 0
+	);
+	const glm::vec3 EnvironmentIllumination(const glm::vec3& p, const glm::vec3& n, const glm::vec3& diffuse);
 	const glm::vec2 GetUV(const glm::vec2& c, Triangle* t) const;
 	const glm::vec3 GetSmoothNormal(const glm::vec2& c, Triangle* t) const;
 	const glm::vec2 SampleCircle();
-	const glm::vec3 Trace(const glm::vec3& ro, const glm::vec3& rd, int depth = 0, int iter = 0, bool inside = false);
+	const glm::vec3 TraceBounce
+	(
+		const glm::vec3& ro, const glm::vec3& rd, const glm::vec3& weight,
+		const glm::vec3& throughput, int depth, int iter, bool inside, bool sampledLights = false,
+		glm::vec3* lightGroups = 0, const RayCone& cone = RayCone()
+	);
+	const glm::vec3 Trace
+	(
+		const glm::vec3& ro, const glm::vec3& rd, int depth = 0, int iter = 0, bool inside = false,
+		const glm::vec3& throughput = glm::vec3(1.0f), bool sampledLights = false,
+		PrimaryHit* primary = 0, glm::vec3* lightGroups = 0, const RayCone& cone = RayCone()
+	);
 
 public:
 	void LoadObject(const std::string& file, const glm::mat4& model);
@@ -109,15 +250,51 @@ public:
 
 	void SetMaterial(int objId, int elementId, Material& material);
 
+	void SetEnvironmentMap(const std::string& file);
+	const float GetEnvironmentIntensity() const;
+	void SetEnvironmentIntensity(float intensity);
+
 	void BuildBVH();
 	void ResetImage();
 	void ClearScene();
 
 	const int GetSamples() const;
+	const int GetSamplesPerPass() const;
+	void SetSamplesPerPass(int samples);
+	const int GetImageVersion() const;
 	const int GetTriangleCount() const;
 	const int GetTraceDepth() const;
 	void SetTraceDepth(int depth);
-	void SetOutImage(GLubyte* out);
+	const int GetRouletteDepth() const;
+	void SetRouletteDepth(int depth);
+	const bool GetEmissiveTexelImportance() const;
+	void SetEmissiveTexelImportance(bool enable);
+	const bool GetAdaptiveSampling() const;
+	void SetAdaptiveSampling(bool enable);
+	const float GetAdaptiveThreshold() const;
+	void SetAdaptiveThreshold(float threshold);
+	const int GetNumThreads() const;
+	void SetNumThreads(int numThreads);
+	const int GetReservedThreads() const;
+	void SetReservedThreads(int reserved);
+	const TonemapOperator GetTonemapOperator() const;
+	void SetTonemapOperator(TonemapOperator op);
+	const bool GetSrgbOutput() const;
+	void SetSrgbOutput(bool srgb);
+	const bool GetDenoise() const;
+	void SetDenoise(bool enable);
+	const bool GetLightGroups() const;
+	void SetLightGroups(bool enable);
+	// Elements with two or more of the opacity, roughness and metallic maps read them from
+	// one packed texture, one fetch instead of several for 3 extra bytes per texel
+	const bool GetPackMaterialMaps() const;
+	void SetPackMaterialMaps(bool enable);
+	const int GetLightGroupCount() const;
+	const bool GetNavigating() const;
+	void SetNavigating(bool navigating);
+	const int GetNavigationScale() const;
+	const float GetNavigationFrameTime() const;
+	void SetNavigationFrameTime(float millis);
 	void SetResolution(const glm::ivec2& res);
 	const glm::ivec2 GetResolution() const;
 	std::vector<PathTracerLoader::Object> GetLoadedObjects() const;
@@ -126,7 +303,21 @@ public:
 	void SetProjection(float f, float fovy);
 	void SetCameraFocalDist(float dist);
 	void SetCameraAperture(float aperture);
-	void RenderFrame();
+	// Renders the rest of the current pass, or a new one, and returns true once the pass is
+	// complete. With maxMillis > 0 it stops taking tiles after that many milliseconds.
+	const bool RenderFrame(int maxMillis = 0);
+	const bool ResolveImage(GLubyte* out, bool denoise);
+
+	// Render thread: publishes a new frame if the image or the display settings changed
+	void UpdateFrame();
+	const Frame* GetPublishedFrame() const;
+	// Any thread: forces the next frame to be resolved again
+	void InvalidateFrame();
+	// Display thread: takes the newest published frame if there is one
+	const bool AcquireFrame();
+	const Frame& GetFrame() const;
+	const bool ResolveAov(AovType aov, float* out);
+	const bool ResolveLightGroup(int group, float* out);
 	void Exit();
 };
 
@@ -1,4 +1,19 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <ctype.h>
+#include <stdlib.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(_WIN32)
+#include <direct.h>
+#include <io.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <utime.h>
+#endif
 
 #include "pathutil.h"
 
@@ -21,4 +36,109 @@ namespace PathUtil
         std::replace(res.begin(), res.end(), '\\', '/');
         return res;
     }
+
+    std::string CanonicalPath(const std::string& path)
+    {
+#if defined(_WIN32)
+        char full[_MAX_PATH];
+        if (!_fullpath(full, NativePath(path).c_str(), _MAX_PATH))
+            return UniversalPath(path);
+        std::string res = UniversalPath(full);
+        std::transform(res.begin(), res.end(), res.begin(), [](unsigned char c) { return (char)tolower(c); });
+        return res;
+#else
+        // Also resolves symbolic links, fails for files that don't exist
+        char* full = realpath(path.c_str(), 0);
+        if (!full)
+            return UniversalPath(path);
+        std::string res(full);
+        free(full);
+        return res;
+#endif
+    }
+
+    const bool GetFileStamp(const std::string& path, long long& modifiedTime, long long& fileSize)
+    {
+        struct stat fileStat;
+        if (stat(path.c_str(), &fileStat) != 0)
+            return false;
+        modifiedTime = (long long)fileStat.st_mtime;
+        fileSize = (long long)fileStat.st_size;
+        return true;
+    }
+
+    const bool TouchFile(const std::string& path)
+    {
+#if defined(_WIN32)
+        return _utime(NativePath(path).c_str(), 0) == 0;
+#else
+        return utime(NativePath(path).c_str(), 0) == 0;
+#endif
+    }
+
+    std::vector<std::string> ListFiles(const std::string& path)
+    {
+        std::vector<std::string> res;
+#if defined(_WIN32)
+        struct _finddata_t entry;
+        intptr_t handle = _findfirst(NativePath(path + "/*").c_str(), &entry);
+        if (handle == -1)
+            return res;
+        do
+        {
+            if (!(entry.attrib & _A_SUBDIR))
+                res.push_back(entry.name);
+        } while (_findnext(handle, &entry) == 0);
+        _findclose(handle);
+#else
+        DIR* dir = opendir(NativePath(path).c_str());
+        if (!dir)
+            return res;
+        while (struct dirent* entry = readdir(dir))
+        {
+            struct stat fileStat;
+            std::string name = entry->d_name;
+            if (stat((path + "/" + name).c_str(), &fileStat) == 0 && (fileStat.st_mode & S_IFREG) != 0)
+                res.push_back(name);
+        }
+        closedir(dir);
+#endif
+        return res;
+    }
+
+    std::string TempDirectory()
+    {
+#if defined(_WIN32)
+        const char* dir = getenv("TEMP");
+        std::string fallback = ".";
+#else
+        const char* dir = getenv("TMPDIR");
+        std::string fallback = "/tmp";
+#endif
+        if (!dir || !dir[0])
+            return fallback;
+        std::string res = UniversalPath(dir);
+        if (res.back() == '/')
+            res.pop_back();
+        return res;
+    }
+
+    const bool MakeDirectory(const std::string& path)
+    {
+        // Fails harmlessly if it exists or another thread just created it
+#if defined(_WIN32)
+        _mkdir(NativePath(path).c_str());
+#else
+        mkdir(NativePath(path).c_str(), 0755);
+#endif
+        struct stat fileStat;
+        return stat(path.c_str(), &fileStat) == 0 && (fileStat.st_mode & S_IFDIR) != 0;
+    }
+
+    std::string UniqueName()
+    {
+        static std::atomic<int> counter(0);
+        long long stamp = (long long)std::chrono::system_clock::now().time_since_epoch().count();
+        return std::to_string(stamp) + "_" + std::to_string(counter++);
+    }
 }
@@ -2,11 +2,27 @@
 #define __PATHUTIL_H__
 
 #include <string>
+#include <vector>
 
 namespace PathUtil
 {
 	std::string NativePath(const std::string& path);
 	std::string UniversalPath(const std::string& path);
+	// Absolute with universal separators and no . or .. segments, case folded where file names
+	// are case insensitive. Any spelling of a file gives the same string, e.g. as a cache key.
+	std::string CanonicalPath(const std::string& path);
+	// Modification time and size, used to tell whether a cached file is still current
+	const bool GetFileStamp(const std::string& path, long long& modifiedTime, long long& fileSize);
+	// Sets the modification time to now, e.g. to tell which cached files were used last
+	const bool TouchFile(const std::string& path);
+	// Names of the files in the directory, subdirectories aren't listed
+	std::vector<std::string> ListFiles(const std::string& path);
+	// The user's directory for temporary files, without a trailing separator
+	std::string TempDirectory();
+	// Creates the directory if it doesn't exist, its parent must exist
+	const bool MakeDirectory(const std::string& path);
+	// Differs on every call, across instances of the application too, e.g. for temporary files
+	std::string UniqueName();
 }
 
 #endif
@@ -2,6 +2,7 @@
 #include <unordered_map>
 
 #include "image.h"
+#include "texturecache.h"
 
 #include "previewer.h"
 
@@ -14,6 +15,7 @@ Previewer::Previewer()
     mCamFovy = 70;
     mCamFocalDist = 5.0f;
     mCamF = 32.0f;
+    mTexturesPending = false;
 }
 
 Previewer::~Previewer()
@@ -198,8 +200,8 @@ void Previewer::ComputeAllSmoothingNormals
 
 void Previewer::ComputeSmoothingShape
 (
-    tinyobj::attrib_t& inattrib,
-    tinyobj::shape_t& inshape,
+    const tinyobj::attrib_t& inattrib,
+    const tinyobj::shape_t& inshape,
     std::vector<std::pair<unsigned int, unsigned int>>& sortedids,
     unsigned int idbegin,
     unsigned int idend,
@@ -262,15 +264,15 @@ void Previewer::ComputeSmoothingShape
 
 void Previewer::ComputeSmoothingShapes
 (
-    tinyobj::attrib_t& inattrib,
-    std::vector<tinyobj::shape_t>& inshapes,
+    const tinyobj::attrib_t& inattrib,
+    const std::vector<tinyobj::shape_t>& inshapes,
     std::vector<tinyobj::shape_t>& outshapes,
     tinyobj::attrib_t& outattrib
 )
 {
     for (size_t s = 0, slen = inshapes.size(); s < slen; ++s)
     {
-        tinyobj::shape_t& inshape = inshapes[s];
+        const tinyobj::shape_t& inshape = inshapes[s];
 
         unsigned int numfaces = static_cast<unsigned int>(inshape.mesh.smoothing_group_ids.size());
         std::vector<std::pair<unsigned int, unsigned int>> sortedids(numfaces);
@@ -305,13 +307,13 @@ const bool Previewer::LoadObject(const std::string& filename, int id)
     PreviewerLoader::Object obj(objName);
     obj.filename = filename;
 
-    tinyobj::attrib_t inattrib;
-    std::vector<tinyobj::shape_t> inshapes;
-    std::vector<tinyobj::material_t> materials;
-    std::string warn;
-    std::string err;
-    if (!tinyobj::LoadObj(&inattrib, &inshapes, &materials, &warn, &err, filename.c_str()))
+    // Parsed once and shared with the path tracer
+    std::shared_ptr<const MeshCache::Mesh> mesh = MeshCache::Load(filename);
+    if (!mesh)
         return false;
+    obj.mesh = mesh;
+    const tinyobj::attrib_t& inattrib = mesh->attrib;
+    const std::vector<tinyobj::shape_t>& inshapes = mesh->shapes;
 
     bool regen_all_normals = inattrib.normals.size() == 0;
     tinyobj::attrib_t outattrib;
@@ -322,8 +324,8 @@ const bool Previewer::LoadObject(const std::string& filename, int id)
         ComputeAllSmoothingNormals(outattrib, outshapes);
     }
 
-    std::vector<tinyobj::shape_t>& shapes = regen_all_normals ? outshapes : inshapes;
-    tinyobj::attrib_t& attrib = regen_all_normals ? outattrib : inattrib;
+    const std::vector<tinyobj::shape_t>& shapes = regen_all_normals ? outshapes : inshapes;
+    const tinyobj::attrib_t& attrib = regen_all_normals ? outattrib : inattrib;
 
     if (shapes.size() == 0)
         return false;
@@ -530,17 +532,30 @@ std::vector<PreviewerLoader::Object> Previewer::GetLoadedObjects() const
     return mLoadedObjects;
 }
 
-GLuint Previewer::LoadTexture(const std::string& file)
+void Previewer::RequestTexture
+(
+    const std::string& file, std::shared_ptr<Image>& imageOut, TextureFormat format
+)
 {
-    GLuint tex = -1;
-    Image texture(file);
-    if (!texture.data())
-        return tex;
+    imageOut.reset();
+    if (file.size() == 0)
+        return;
+    imageOut = TextureCache::Request(file, format);
+    mTexturesPending = true;
+}
 
+GLuint Previewer::UploadTexture(Image& image)
+{
+    // The image keeps its texels tiled for the path tracer, levels too large for memory are
+    // left out
+    int width, height;
+    std::vector<unsigned char> rows = image.rows(width, height);
+
+    GLuint tex;
     glGenTextures(1, &tex);
     glBindTexture(GL_TEXTURE_2D, tex);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texture.width(), texture.height(), 0,
-        GL_RGBA, GL_UNSIGNED_BYTE, texture.data());
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0,
+        GL_RGBA, GL_UNSIGNED_BYTE, rows.data());
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
@@ -550,6 +565,44 @@ GLuint Previewer::LoadTexture(const std::string& file)
     return tex;
 }
 
+const bool Previewer::UploadPendingTexture(const std::shared_ptr<Image>& image, GLuint& texOut)
+{
+    if (texOut != -1 || !image)
+        return false;
+    if (!TextureCache::IsLoaded(image))
+    {
+        mTexturesPending = true;
+        return false;
+    }
+    // A file that can't be decoded stays without a GL texture
+    if (!image->data())
+        return false;
+    texOut = UploadTexture(*image);
+    return true;
+}
+
+const bool Previewer::UploadTextures()
+{
+    if (!mTexturesPending)
+        return false;
+    mTexturesPending = false;
+
+    bool uploaded = false;
+    for (auto& obj : mLoadedObjects)
+    {
+        for (auto& element : obj.elements)
+        {
+            uploaded |= UploadPendingTexture(element.diffuseTexImage, element.diffuseTexId);
+            uploaded |= UploadPendingTexture(element.normalTexImage, element.normalTexId);
+            uploaded |= UploadPendingTexture(element.emissTexImage, element.emissTexId);
+            uploaded |= UploadPendingTexture(element.roughnessTexImage, element.roughnessTexId);
+            uploaded |= UploadPendingTexture(element.metallicTexImage, element.metallicTexId);
+            uploaded |= UploadPendingTexture(element.opacityTexImage, element.opacityTexId);
+        }
+    }
+    return uploaded;
+}
+
 void Previewer::FreeObject(int objId)
 {
     if (objId >= mLoadedObjects.size())
@@ -588,7 +641,7 @@ void Previewer::SetDiffuseTextureForElement(int objId, int elementId, const std:
         glDeleteTextures(1, &tex);
         tex = -1;
     }
-    tex = LoadTexture(file);
+    RequestTexture(file, mLoadedObjects[objId].elements[elementId].diffuseTexImage);
     mLoadedObjects[objId].elements[elementId].diffuseTexFile = file;
 }
 
@@ -605,7 +658,8 @@ void Previewer::SetNormalTextureForElement(int objId, int elementId, const std::
         glDeleteTextures(1, &tex);
         tex = -1;
     }
-    tex = LoadTexture(file);
+    // Stored the way the path tracer reads it, so both share one decode
+    RequestTexture(file, mLoadedObjects[objId].elements[elementId].normalTexImage, TextureFormat::NORMAL_XY);
     mLoadedObjects[objId].elements[elementId].normalTexFile = file;
 }
 
@@ -622,7 +676,7 @@ void Previewer::SetEmissTextureForElement(int objId, int elementId, const std::s
         glDeleteTextures(1, &tex);
         tex = -1;
     }
-    tex = LoadTexture(file);
+    RequestTexture(file, mLoadedObjects[objId].elements[elementId].emissTexImage);
     mLoadedObjects[objId].elements[elementId].emissTexFile = file;
 }
 
@@ -639,7 +693,7 @@ void Previewer::SetRoughnessTextureForElement(int objId, int elementId, const st
         glDeleteTextures(1, &tex);
         tex = -1;
     }
-    tex = LoadTexture(file);
+    RequestTexture(file, mLoadedObjects[objId].elements[elementId].roughnessTexImage, TextureFormat::R);
     mLoadedObjects[objId].elements[elementId].roughnessTexFile = file;
 }
 
@@ -656,7 +710,7 @@ void Previewer::SetMetallicTextureForElement(int objId, int elementId, const std
         glDeleteTextures(1, &tex);
         tex = -1;
     }
-    tex = LoadTexture(file);
+    RequestTexture(file, mLoadedObjects[objId].elements[elementId].metallicTexImage, TextureFormat::R);
     mLoadedObjects[objId].elements[elementId].metallicTexFile = file;
 }
 
@@ -673,7 +727,7 @@ void Previewer::SetOpacityTextureForElement(int objId, int elementId, const std:
         glDeleteTextures(1, &tex);
         tex = -1;
     }
-    tex = LoadTexture(file);
+    RequestTexture(file, mLoadedObjects[objId].elements[elementId].opacityTexImage, TextureFormat::R);
     mLoadedObjects[objId].elements[elementId].opacityTexFile = file;
 }
 
@@ -775,38 +829,32 @@ void Previewer::SendObjectsToPathTracer(PathTracer* pPathTracer)
         for (int j = 0; j < mLoadedObjects[i].elements.size(); j++)
         {
             pPathTracer->SetMaterial(i, j, mLoadedObjects[i].elements[j].material);
-            GLuint texId = mLoadedObjects[i].elements[j].diffuseTexId;
-            if (texId != -1)
+            if (mLoadedObjects[i].elements[j].diffuseTexImage)
             {
                 pPathTracer->SetDiffuseTextureForElement(i, j,
                     mLoadedObjects[i].elements[j].diffuseTexFile);
             }
-            texId = mLoadedObjects[i].elements[j].normalTexId;
-            if (texId != -1)
+            if (mLoadedObjects[i].elements[j].normalTexImage)
             {
                 pPathTracer->SetNormalTextureForElement(i, j,
                     mLoadedObjects[i].elements[j].normalTexFile);
             }
-            texId = mLoadedObjects[i].elements[j].emissTexId;
-            if (texId != -1)
+            if (mLoadedObjects[i].elements[j].emissTexImage)
             {
                 pPathTracer->SetEmissTextureForElement(i, j,
                     mLoadedObjects[i].elements[j].emissTexFile);
             }
-            texId = mLoadedObjects[i].elements[j].roughnessTexId;
-            if (texId != -1)
+            if (mLoadedObjects[i].elements[j].roughnessTexImage)
             {
                 pPathTracer->SetRoughnessTextureForElement(i, j,
                     mLoadedObjects[i].elements[j].roughnessTexFile);
             }
-            texId = mLoadedObjects[i].elements[j].metallicTexId;
-            if (texId != -1)
+            if (mLoadedObjects[i].elements[j].metallicTexImage)
             {
                 pPathTracer->SetMetallicTextureForElement(i, j,
                     mLoadedObjects[i].elements[j].metallicTexFile);
             }
-            texId = mLoadedObjects[i].elements[j].opacityTexId;
-            if (texId != -1)
+            if (mLoadedObjects[i].elements[j].opacityTexImage)
             {
                 pPathTracer->SetOpacityTextureForElement(i, j,
                     mLoadedObjects[i].elements[j].opacityTexFile);
@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
 
 #include <GL/glew.h>
 #include <glm/glm.hpp>
@@ -11,6 +12,7 @@
 
 #include <tiny_obj_loader.h>
 
+#include "meshcache.h"
 #include "pathtracer.h"
 
 namespace PreviewerLoader
@@ -35,16 +37,22 @@ namespace PreviewerLoader
 
         GLuint diffuseTexId;
         std::string diffuseTexFile;
+        std::shared_ptr<Image> diffuseTexImage;
         GLuint normalTexId;
         std::string normalTexFile;
+        std::shared_ptr<Image> normalTexImage;
         GLuint emissTexId;
         std::string emissTexFile;
+        std::shared_ptr<Image> emissTexImage;
         GLuint roughnessTexId;
         std::string roughnessTexFile;
+        std::shared_ptr<Image> roughnessTexImage;
         GLuint metallicTexId;
         std::string metallicTexFile;
+        std::shared_ptr<Image> metallicTexImage;
         GLuint opacityTexId;
         std::string opacityTexFile;
+        std::shared_ptr<Image> opacityTexImage;
 
         Material material;
         bool highlight;
@@ -77,6 +85,8 @@ namespace PreviewerLoader
         std::string name;
         std::string filename;
         std::vector<Element> elements;
+        // Keeps the parsed file cached for the path tracer
+        std::shared_ptr<const MeshCache::Mesh> mesh;
 
         glm::mat4 M;
         glm::mat4 Mpreview;
@@ -156,6 +166,8 @@ class Previewer
 {
 private:
     std::vector<PreviewerLoader::Object> mLoadedObjects;
+    // Some element has a texture that isn't uploaded yet
+    bool mTexturesPending;
 
     glm::vec3 mCamPos;
     glm::vec3 mCamDir;
@@ -196,8 +208,8 @@ private:
     );
     void ComputeSmoothingShape
     (
-        tinyobj::attrib_t& inattrib,
-        tinyobj::shape_t& inshape,
+        const tinyobj::attrib_t& inattrib,
+        const tinyobj::shape_t& inshape,
         std::vector<std::pair<unsigned int, unsigned int>>& sortedids,
         unsigned int idbegin,
         unsigned int idend,
@@ -206,13 +218,21 @@ private:
     );
     void ComputeSmoothingShapes
     (
-        tinyobj::attrib_t& inattrib,
-        std::vector<tinyobj::shape_t>& inshapes,
+        const tinyobj::attrib_t& inattrib,
+        const std::vector<tinyobj::shape_t>& inshapes,
         std::vector<tinyobj::shape_t>& outshapes,
         tinyobj::attrib_t& outattrib
     );
 
-    GLuint LoadTexture(const std::string& file);
+    // The decoded image comes from the texture cache and is shared with the path tracer,
+    // the GL texture is created by UploadTextures once the image is decoded
+    void RequestTexture
+    (
+        const std::string& file, std::shared_ptr<Image>& imageOut,
+        TextureFormat format = TextureFormat::RGBA
+    );
+    GLuint UploadTexture(Image& image);
+    const bool UploadPendingTexture(const std::shared_ptr<Image>& image, GLuint& texOut);
 
     void FreeObject(int objId);
 
@@ -226,6 +246,8 @@ public:
     void SetRoughnessTextureForElement(int objId, int elementId, const std::string& file);
     void SetMetallicTextureForElement(int objId, int elementId, const std::string& file);
     void SetOpacityTextureForElement(int objId, int elementId, const std::string& file);
+    // Creates the GL textures of the images decoded so far, returns true if there were any
+    const bool UploadTextures();
 
     void SetMaterial(int objId, int elementId, const Material& m);
 
@@ -0,0 +1,207 @@
+#include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "pathutil.h"
+#include "texturecache.h"
+
+namespace TextureCache
+{
+	struct Entry
+	{
+		std::weak_ptr<Image> image;
+		long long modifiedTime;
+		long long fileSize;
+	};
+
+	struct Job
+	{
+		std::shared_ptr<Image> image;
+		std::string filename;
+		TextureFormat format;
+		bool compress;
+		std::string key;
+	};
+
+	static std::mutex cacheMutex;
+	static std::map<std::string, Entry> cache;
+	// Images queued or being decoded
+	static std::set<const Image*> pending;
+	static std::deque<Job> jobs;
+	static std::condition_variable jobQueued;
+	static std::condition_variable jobDone;
+	static bool compression = false;
+
+	static void Decode(Job& job)
+	{
+		{
+			std::lock_guard<std::mutex> lock(cacheMutex);
+			// Everybody let go of the image while it was queued, the cache can't hand it
+			// out anymore while the lock is held
+			if (job.image.use_count() == 1)
+			{
+				cache.erase(job.key);
+				pending.erase(job.image.get());
+				jobDone.notify_all();
+				return;
+			}
+		}
+
+		job.image->Load(job.filename, job.format, job.compress);
+
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		// Failed decodes aren't cached, the file may be fixed
+		if (!job.image->data())
+		{
+			auto it = cache.find(job.key);
+			if (it != cache.end() && it->second.image.lock() == job.image)
+				cache.erase(it);
+		}
+		pending.erase(job.image.get());
+		jobDone.notify_all();
+	}
+
+	class Loader
+	{
+	private:
+		std::vector<std::thread> mThreads;
+		bool mQuit;
+
+		void WorkerLoop()
+		{
+			while (true)
+			{
+				Job job;
+				{
+					std::unique_lock<std::mutex> lock(cacheMutex);
+					jobQueued.wait(lock, [&] { return mQuit || !jobs.empty(); });
+					if (mQuit)
+						return;
+					job = jobs.front();
+					jobs.pop_front();
+				}
+				Decode(job);
+			}
+		}
+
+	public:
+		Loader()
+		{
+			mQuit = false;
+			int numThreads = glm::max((int)std::thread::hardware_concurrency(), 1);
+			for (int i = 0; i < numThreads; i++)
+				mThreads.push_back(std::thread(&Loader::WorkerLoop, this));
+		}
+
+		~Loader()
+		{
+			{
+				std::lock_guard<std::mutex> lock(cacheMutex);
+				mQuit = true;
+			}
+			jobQueued.notify_all();
+			for (auto& thread : mThreads)
+				thread.join();
+		}
+	};
+
+	std::shared_ptr<Image> Request(const std::string& filename, TextureFormat format)
+	{
+		// Started with the first texture
+		static Loader loader;
+
+		std::string path = PathUtil::UniversalPath(filename);
+		long long modifiedTime = 0, fileSize = 0;
+		if (!PathUtil::GetFileStamp(path, modifiedTime, fileSize))
+			return std::make_shared<Image>();
+		std::shared_ptr<Image> image;
+		{
+			std::lock_guard<std::mutex> lock(cacheMutex);
+			std::string key = PathUtil::CanonicalPath(path) + "#" + std::to_string((int)format) + (compression ? "#bc" : "");
+			auto it = cache.find(key);
+			if (it != cache.end())
+			{
+				image = it->second.image.lock();
+				if (image && it->second.modifiedTime == modifiedTime && it->second.fileSize == fileSize)
+					return image;
+				cache.erase(it);
+			}
+
+			// Drop entries nobody holds anymore
+			for (auto it = cache.begin(); it != cache.end();)
+			{
+				if (it->second.image.expired())
+					it = cache.erase(it);
+				else
+					it++;
+			}
+
+			image = std::make_shared<Image>();
+			Entry& entry = cache[key];
+			entry.image = image;
+			entry.modifiedTime = modifiedTime;
+			entry.fileSize = fileSize;
+
+			Job job;
+			job.image = image;
+			job.filename = filename;
+			job.format = format;
+			job.compress = compression;
+			job.key = key;
+			jobs.push_back(job);
+			pending.insert(image.get());
+		}
+		jobQueued.notify_one();
+		return image;
+	}
+
+	const bool IsLoaded(const std::shared_ptr<Image>& image)
+	{
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		return pending.count(image.get()) == 0;
+	}
+
+	void Wait(const std::shared_ptr<Image>& image)
+	{
+		std::unique_lock<std::mutex> lock(cacheMutex);
+		if (pending.count(image.get()) == 0)
+			return;
+
+		// Still queued, don't wait behind textures nobody is waiting for
+		for (auto it = jobs.begin(); it != jobs.end(); it++)
+		{
+			if (it->image == image)
+			{
+				Job job = *it;
+				jobs.erase(it);
+				lock.unlock();
+				Decode(job);
+				return;
+			}
+		}
+		jobDone.wait(lock, [&] { return pending.count(image.get()) == 0; });
+	}
+
+	std::shared_ptr<Image> Load(const std::string& filename, TextureFormat format)
+	{
+		std::shared_ptr<Image> image = Request(filename, format);
+		Wait(image);
+		return image;
+	}
+
+	void SetCompression(bool compress)
+	{
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		compression = compress;
+	}
+
+	const bool GetCompression()
+	{
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		return compression;
+	}
+}
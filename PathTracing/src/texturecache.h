@@ -0,0 +1,32 @@
+#ifndef __TEXTURECACHE_H__
+#define __TEXTURECACHE_H__
+
+#include <string>
+#include <memory>
+
+#include "image.h"
+
+// Decoded texture images shared by every element and map using the same file, and by the
+// previewer and the path tracer. Entries are keyed by the universal path and validated
+// against the file's modification time and size, an image is freed with its last user.
+// Decoding and resizing run on a pool of loader threads so a scene's textures load in
+// parallel, a user only blocks on the images it actually needs.
+namespace TextureCache
+{
+	// Queues the decode and returns at once, the image is empty until it is loaded.
+	// A loaded image has no data if the file can't be read. Every format of a file is
+	// cached on its own.
+	std::shared_ptr<Image> Request(const std::string& filename, TextureFormat format = TextureFormat::RGBA);
+	// Never blocks
+	const bool IsLoaded(const std::shared_ptr<Image>& image);
+	// Decodes the image on the calling thread if no loader thread has started on it yet
+	void Wait(const std::shared_ptr<Image>& image);
+	// Request and Wait
+	std::shared_ptr<Image> Load(const std::string& filename, TextureFormat format = TextureFormat::RGBA);
+	// Block compresses the images requested from now on, images already loaded keep their
+	// storage. Off by default.
+	void SetCompression(bool compress);
+	const bool GetCompression();
+}
+
+#endif
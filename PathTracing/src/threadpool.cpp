@@ -0,0 +1,139 @@
+#include "threadpool.h"
+
+ThreadPool::ThreadPool()
+{
+	mGeneration = 0;
+	mBusy = 0;
+	mQuit = false;
+	mQueues.push_back(new TaskQueue());
+}
+
+ThreadPool::~ThreadPool()
+{
+	Stop();
+	for (auto queue : mQueues)
+		delete queue;
+}
+
+void ThreadPool::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQuit = true;
+	}
+	mWake.notify_all();
+	for (auto& thread : mThreads)
+		thread.join();
+	mThreads.clear();
+	mQuit = false;
+}
+
+void ThreadPool::WorkerLoop(int worker, int generation)
+{
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mWake.wait(lock, [&] { return mQuit || mGeneration != generation; });
+			if (mQuit)
+				return;
+			generation = mGeneration;
+		}
+
+		Work(worker);
+
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (--mBusy == 0)
+			mDone.notify_all();
+	}
+}
+
+void ThreadPool::Work(int worker)
+{
+	int task;
+	while (PopTask(worker, task))
+		mJob(task, worker);
+}
+
+const bool ThreadPool::PopTask(int worker, int& taskOut)
+{
+	// Own tasks in order first
+	{
+		TaskQueue* queue = mQueues[worker];
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		if (!queue->tasks.empty())
+		{
+			taskOut = queue->tasks.front();
+			queue->tasks.pop_front();
+			return true;
+		}
+	}
+	// Then steal from the end of the other workers' ranges
+	int numQueues = mQueues.size();
+	for (int i = 1; i < numQueues; i++)
+	{
+		TaskQueue* queue = mQueues[(worker + i) % numQueues];
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		if (!queue->tasks.empty())
+		{
+			taskOut = queue->tasks.back();
+			queue->tasks.pop_back();
+			return true;
+		}
+	}
+	return false;
+}
+
+const int ThreadPool::GetNumThreads() const
+{
+	return mQueues.size();
+}
+
+void ThreadPool::Resize(int numThreads)
+{
+	if (numThreads < 1)
+		numThreads = 1;
+	if (numThreads == GetNumThreads())
+		return;
+
+	Stop();
+	for (size_t i = numThreads; i < mQueues.size(); i++)
+		delete mQueues[i];
+	mQueues.resize(numThreads, 0);
+	for (int i = 1; i < numThreads; i++)
+	{
+		if (!mQueues[i])
+			mQueues[i] = new TaskQueue();
+		mThreads.push_back(std::thread(&ThreadPool::WorkerLoop, this, i, mGeneration));
+	}
+}
+
+void ThreadPool::Run(int numTasks, const std::function<void(int, int)>& job)
+{
+	if (numTasks <= 0)
+		return;
+
+	// Hand out contiguous ranges so every worker starts on neighbouring tasks
+	int numQueues = mQueues.size();
+	for (int w = 0; w < numQueues; w++)
+	{
+		int begin = (int)((long long)numTasks * w / numQueues);
+		int end = (int)((long long)numTasks * (w + 1) / numQueues);
+		std::lock_guard<std::mutex> lock(mQueues[w]->mutex);
+		for (int i = begin; i < end; i++)
+			mQueues[w]->tasks.push_back(i);
+	}
+
+	mJob = job;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mBusy = mThreads.size();
+		mGeneration++;
+	}
+	mWake.notify_all();
+
+	Work(0);
+
+	std::unique_lock<std::mutex> lock(mMutex);
+	mDone.wait(lock, [&] { return mBusy == 0; });
+}
@@ -0,0 +1,52 @@
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Persistent fork/join pool with one task queue per worker. Every job is split into
+// contiguous task ranges, workers pop from the front of their own range and steal
+// from the back of the others' once they run dry. The calling thread is worker 0.
+class ThreadPool
+{
+private:
+	struct TaskQueue
+	{
+		std::mutex mutex;
+		std::deque<int> tasks;
+	};
+
+	std::vector<std::thread> mThreads;
+	std::vector<TaskQueue*> mQueues;
+	std::function<void(int, int)> mJob;
+
+	std::mutex mMutex;
+	std::condition_variable mWake;
+	std::condition_variable mDone;
+	int mGeneration;
+	int mBusy;
+	bool mQuit;
+
+public:
+	ThreadPool();
+	~ThreadPool();
+
+private:
+	void Stop();
+	void WorkerLoop(int worker, int generation);
+	void Work(int worker);
+	const bool PopTask(int worker, int& taskOut);
+
+public:
+	const int GetNumThreads() const;
+	void Resize(int numThreads);
+
+	// Runs job(task, worker) for every task in [0, numTasks) and returns when all are done
+	void Run(int numTasks, const std::function<void(int, int)>& job);
+};
+
+#endif
@@ -0,0 +1,232 @@
+#include <list>
+#include <algorithm>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+
+#include "pathutil.h"
+#include "tilecache.h"
+
+namespace TileCache
+{
+	// A power of two, neighbouring tiles of an image land in different shards
+	const int NUM_SHARDS = 16;
+
+	struct TileKey
+	{
+		TileSource* source;
+		long long offset;
+
+		bool operator==(const TileKey& other) const
+		{
+			return source == other.source && offset == other.offset;
+		}
+	};
+
+	struct TileKeyHash
+	{
+		size_t operator()(const TileKey& key) const
+		{
+			return std::hash<TileSource*>()(key.source) ^ std::hash<long long>()(key.offset);
+		}
+	};
+
+	struct Tile
+	{
+		TileKey key;
+		std::vector<unsigned char> data;
+	};
+
+	struct Shard
+	{
+		std::mutex mutex;
+		// Most recently used first
+		std::list<Tile> tiles;
+		std::unordered_map<TileKey, std::list<Tile>::iterator, TileKeyHash> index;
+		size_t bytes = 0;
+	};
+
+	static std::atomic<size_t> budget((size_t)1 << 30);
+
+	// Never destroyed, images held by other statics may release their sources after this
+	// file's statics are gone
+	static Shard* Shards()
+	{
+		static Shard* shards = new Shard[NUM_SHARDS];
+		return shards;
+	}
+
+	static Shard& ShardOf(const TileKey& key, int tileBytes)
+	{
+		size_t tile = (size_t)(key.offset / tileBytes) + std::hash<TileSource*>()(key.source);
+		return Shards()[tile & (NUM_SHARDS - 1)];
+	}
+
+	// The shard's lock must be held
+	static void Evict(Shard& shard, size_t limit)
+	{
+		while (shard.bytes > limit && !shard.tiles.empty())
+		{
+			Tile& tile = shard.tiles.back();
+			shard.bytes -= tile.data.size();
+			shard.index.erase(tile.key);
+			shard.tiles.pop_back();
+		}
+	}
+
+	static void Release(TileSource* source)
+	{
+		for (int i = 0; i < NUM_SHARDS; i++)
+		{
+			Shard& shard = Shards()[i];
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			for (auto it = shard.tiles.begin(); it != shard.tiles.end();)
+			{
+				if (it->key.source == source)
+				{
+					shard.bytes -= it->data.size();
+					shard.index.erase(it->key);
+					it = shard.tiles.erase(it);
+				}
+				else
+					it++;
+			}
+		}
+	}
+
+	TileSource::~TileSource()
+	{
+		Release(this);
+	}
+
+	PageFile::PageFile() :
+		mSize(0)
+	{
+		mFilename = PathUtil::TempDirectory() + "/pathtracing_tiles_" + PathUtil::UniqueName() + ".tmp";
+		mFile.open(PathUtil::NativePath(mFilename), std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+	}
+
+	PageFile::~PageFile()
+	{
+		if (mFile.is_open())
+		{
+			mFile.close();
+			remove(PathUtil::NativePath(mFilename).c_str());
+		}
+	}
+
+	const long long PageFile::Append(const unsigned char* data, size_t size)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (!mFile.is_open())
+			return -1;
+		mFile.seekp(mSize);
+		mFile.write((const char*)data, size);
+		if (!mFile)
+		{
+			mFile.clear();
+			return -1;
+		}
+		long long offset = mSize;
+		mSize += size;
+		return offset;
+	}
+
+	const bool PageFile::Read(long long offset, unsigned char* data, size_t size)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (!mFile.is_open())
+			return false;
+		mFile.seekg(offset);
+		mFile.read((char*)data, size);
+		if (!mFile)
+		{
+			mFile.clear();
+			return false;
+		}
+		return true;
+	}
+
+	MappedTiles::MappedTiles(const std::shared_ptr<MappedFile>& file) :
+		mFile(file)
+	{
+	}
+
+	const bool MappedTiles::Read(long long offset, unsigned char* data, size_t size)
+	{
+		if (!mFile->data() || offset < 0 || (size_t)offset > mFile->size() || size > mFile->size() - (size_t)offset)
+			return false;
+		memcpy(data, mFile->data() + offset, size);
+		return true;
+	}
+
+	void Read
+	(
+		TileSource* source, long long tileOffset, int tileBytes,
+		const int* offsets, int count, int size, unsigned char* data
+	)
+	{
+		TileKey key = { source, tileOffset };
+		Shard& shard = ShardOf(key, tileBytes);
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto it = shard.index.find(key);
+			if (it != shard.index.end())
+			{
+				shard.tiles.splice(shard.tiles.begin(), shard.tiles, it->second);
+				for (int i = 0; i < count; i++)
+					memcpy(data + i * size, it->second->data.data() + offsets[i], size);
+				return;
+			}
+		}
+
+		// Other threads keep using the shard while the tile is read, a tile that can't be
+		// read is black
+		Tile tile;
+		tile.key = key;
+		tile.data.resize(tileBytes);
+		if (!source->Read(tileOffset, tile.data.data(), tileBytes))
+			std::fill(tile.data.begin(), tile.data.end(), 0);
+		for (int i = 0; i < count; i++)
+			memcpy(data + i * size, tile.data.data() + offsets[i], size);
+
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		// Another thread may have read it meanwhile
+		if (shard.index.count(key))
+			return;
+		shard.tiles.push_front(std::move(tile));
+		shard.index[key] = shard.tiles.begin();
+		shard.bytes += tileBytes;
+		Evict(shard, budget / NUM_SHARDS);
+	}
+
+	void SetBudget(size_t bytes)
+	{
+		budget = bytes;
+		for (int i = 0; i < NUM_SHARDS; i++)
+		{
+			Shard& shard = Shards()[i];
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			Evict(shard, bytes / NUM_SHARDS);
+		}
+	}
+
+	const size_t GetBudget()
+	{
+		return budget;
+	}
+
+	const size_t GetResidentBytes()
+	{
+		size_t bytes = 0;
+		for (int i = 0; i < NUM_SHARDS; i++)
+		{
+			Shard& shard = Shards()[i];
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			bytes += shard.bytes;
+		}
+		return bytes;
+	}
+}
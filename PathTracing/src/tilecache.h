@@ -0,0 +1,71 @@
+#ifndef __TILECACHE_H__
+#define __TILECACHE_H__
+
+#include <string>
+#include <fstream>
+#include <mutex>
+#include <memory>
+
+#include "mappedfile.h"
+
+// Tiles of texture levels too large to keep in memory. Each image reads those levels from its
+// own page file or its mapped texture cache file, tiles are copied in on first access and the
+// least recently used ones are evicted once the cache exceeds its budget. Tiles are spread over
+// independently locked shards so render threads rarely wait on each other.
+namespace TileCache
+{
+	// Where tiles are read from on a miss, its cached tiles are dropped along with it
+	class TileSource
+	{
+	public:
+		virtual ~TileSource();
+
+		virtual const bool Read(long long offset, unsigned char* data, size_t size) = 0;
+	};
+
+	// A temporary file, removed with its object
+	class PageFile : public TileSource
+	{
+	private:
+		std::string mFilename;
+		std::fstream mFile;
+		long long mSize;
+		std::mutex mMutex;
+
+	public:
+		PageFile();
+		~PageFile();
+
+		// Returns the offset of the bytes in the file, -1 if they couldn't be written
+		const long long Append(const unsigned char* data, size_t size);
+		const bool Read(long long offset, unsigned char* data, size_t size) override;
+	};
+
+	// Levels of a mapped file, copied out a tile at a time so only the tiles in use count
+	// against the budget
+	class MappedTiles : public TileSource
+	{
+	private:
+		std::shared_ptr<MappedFile> mFile;
+
+	public:
+		MappedTiles(const std::shared_ptr<MappedFile>& file);
+
+		const bool Read(long long offset, unsigned char* data, size_t size) override;
+	};
+
+	// Copies count runs of size bytes at offsets within the tile at tileOffset in the source
+	// back to back to data, reading the whole tile on a miss
+	void Read
+	(
+		TileSource* source, long long tileOffset, int tileBytes,
+		const int* offsets, int count, int size, unsigned char* data
+	);
+
+	// Bytes of tiles kept in memory across all images, 1 GB by default
+	void SetBudget(size_t bytes);
+	const size_t GetBudget();
+	const size_t GetResidentBytes();
+}
+
+#endif
@@ -0,0 +1,142 @@
+#include <math.h>
+#include <emmintrin.h>
+
+#include <omp.h>
+
+#include "tonemapper.h"
+
+// Number of steps the [0, 1] range is quantized to before the 8 bit encoding lookup
+const int ENCODE_LUT_SIZE = 4096;
+
+// Narkowicz's fit of the ACES filmic curve
+const float ACES_A = 2.51f;
+const float ACES_B = 0.03f;
+const float ACES_C = 2.43f;
+const float ACES_D = 0.59f;
+const float ACES_E = 0.14f;
+
+static inline __m128 TonemapSse(__m128 x, TonemapOperator op)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	// max(x, 0) also flushes NaNs to 0
+	x = _mm_max_ps(x, zero);
+	if (op == TonemapOperator::REINHARD)
+		x = _mm_div_ps(x, _mm_add_ps(x, one));
+	else if (op == TonemapOperator::ACES)
+	{
+		__m128 num = _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(ACES_A)), _mm_set1_ps(ACES_B)));
+		__m128 den = _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(ACES_C)), _mm_set1_ps(ACES_D))), _mm_set1_ps(ACES_E));
+		x = _mm_div_ps(num, den);
+	}
+	return _mm_min_ps(_mm_max_ps(x, zero), one);
+}
+
+Tonemapper::Tonemapper()
+{
+	mOperator = TonemapOperator::CLAMP;
+	mSrgb = false;
+	mEncodeLut = new GLubyte[ENCODE_LUT_SIZE];
+	BuildEncodeLut();
+}
+
+Tonemapper::~Tonemapper()
+{
+	if (mEncodeLut)
+		delete[] mEncodeLut;
+}
+
+void Tonemapper::BuildEncodeLut()
+{
+	for (int i = 0; i < ENCODE_LUT_SIZE; i++)
+	{
+		float x = (float)i / (float)(ENCODE_LUT_SIZE - 1);
+		if (mSrgb)
+			x = x <= 0.0031308f ? x * 12.92f : 1.055f * powf(x, 1.0f / 2.4f) - 0.055f;
+		mEncodeLut[i] = (GLubyte)(glm::clamp(x, 0.0f, 1.0f) * 255.0f + 0.5f);
+	}
+}
+
+const float Tonemapper::ApplyOperator(float x) const
+{
+	x = x > 0.0f ? x : 0.0f;
+	if (mOperator == TonemapOperator::REINHARD)
+		x = x / (1.0f + x);
+	else if (mOperator == TonemapOperator::ACES)
+		x = (x * (ACES_A * x + ACES_B)) / (x * (ACES_C * x + ACES_D) + ACES_E);
+	return glm::clamp(x, 0.0f, 1.0f);
+}
+
+const TonemapOperator Tonemapper::GetOperator() const
+{
+	return mOperator;
+}
+
+void Tonemapper::SetOperator(TonemapOperator op)
+{
+	mOperator = op;
+}
+
+const bool Tonemapper::GetSrgb() const
+{
+	return mSrgb;
+}
+
+void Tonemapper::SetSrgb(bool srgb)
+{
+	if (mSrgb == srgb)
+		return;
+	mSrgb = srgb;
+	BuildEncodeLut();
+}
+
+void Tonemapper::Resolve
+(
+	int numPixels, const int* samples, const float* color,
+	GLubyte* out, int numThreads
+) const
+{
+	const TonemapOperator op = mOperator;
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 lutScale = _mm_set1_ps((float)(ENCODE_LUT_SIZE - 1));
+	const __m128 half = _mm_set1_ps(0.5f);
+
+	// 4 pixels are 12 floats, i.e. 3 registers of interleaved rgb
+	int numBlocks = numPixels / 4;
+	#pragma omp parallel for num_threads(numThreads)
+	for (int b = 0; b < numBlocks; b++)
+	{
+		const float* c = color + b * 12;
+		__m128 v[3] = { _mm_loadu_ps(c), _mm_loadu_ps(c + 4), _mm_loadu_ps(c + 8) };
+		if (samples)
+		{
+			__m128 n = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(samples + b * 4)));
+			__m128 inv = _mm_div_ps(one, _mm_max_ps(n, one));
+			// Spread the 4 reciprocals over the rgb layout: 000 1|11 22|2 333
+			v[0] = _mm_mul_ps(v[0], _mm_shuffle_ps(inv, inv, _MM_SHUFFLE(1, 0, 0, 0)));
+			v[1] = _mm_mul_ps(v[1], _mm_shuffle_ps(inv, inv, _MM_SHUFFLE(2, 2, 1, 1)));
+			v[2] = _mm_mul_ps(v[2], _mm_shuffle_ps(inv, inv, _MM_SHUFFLE(3, 3, 3, 2)));
+		}
+
+		int index[12];
+		for (int k = 0; k < 3; k++)
+		{
+			__m128 x = _mm_add_ps(_mm_mul_ps(TonemapSse(v[k], op), lutScale), half);
+			_mm_storeu_si128((__m128i*)(index + k * 4), _mm_cvttps_epi32(x));
+		}
+
+		GLubyte* o = out + b * 12;
+		for (int k = 0; k < 12; k++)
+			o[k] = mEncodeLut[index[k]];
+	}
+
+	for (int i = numBlocks * 4; i < numPixels; i++)
+	{
+		float n = samples ? (float)glm::max(samples[i], 1) : 1.0f;
+		for (int k = 0; k < 3; k++)
+		{
+			float x = ApplyOperator(color[i * 3 + k] / n);
+			out[i * 3 + k] = mEncodeLut[(int)(x * (ENCODE_LUT_SIZE - 1) + 0.5f)];
+		}
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef __TONEMAPPER_H__
+#define __TONEMAPPER_H__
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+enum class TonemapOperator
+{
+	CLAMP,
+	REINHARD,
+	ACES
+};
+
+// Turns accumulated radiance into 8 bit display colors. Tonemapping runs on 4 pixels
+// at a time with SSE, the final 8 bit (optionally sRGB) encoding is a table lookup.
+class Tonemapper
+{
+private:
+	TonemapOperator mOperator;
+	bool mSrgb;
+	// Maps [0, 1] quantized to ENCODE_LUT_SIZE steps to the encoded byte
+	GLubyte* mEncodeLut;
+
+public:
+	Tonemapper();
+	~Tonemapper();
+
+private:
+	void BuildEncodeLut();
+	const float ApplyOperator(float x) const;
+
+public:
+	const TonemapOperator GetOperator() const;
+	void SetOperator(TonemapOperator op);
+	const bool GetSrgb() const;
+	void SetSrgb(bool srgb);
+
+	// color holds per-pixel rgb sums over samples[i] samples, or means if samples is null
+	void Resolve
+	(
+		int numPixels, const int* samples, const float* color,
+		GLubyte* out, int numThreads
+	) const;
+};
+
+#endif
@@ -0,0 +1,45 @@
+#include "triplebuffer.h"
+
+TripleBuffer::TripleBuffer()
+{
+	mBack = 0;
+	mLastPublished = -1;
+	mMiddle = 1;
+	mFront = 2;
+}
+
+Frame& TripleBuffer::GetBackFrame()
+{
+	return mFrames[mBack];
+}
+
+void TripleBuffer::Publish()
+{
+	mLastPublished = mBack;
+	mBack = mMiddle.exchange(mBack | FRESH_BIT, std::memory_order_acq_rel) & ~FRESH_BIT;
+}
+
+const bool TripleBuffer::HasPending() const
+{
+	return (mMiddle.load(std::memory_order_acquire) & FRESH_BIT) != 0;
+}
+
+const Frame* TripleBuffer::GetPublishedFrame() const
+{
+	if (mLastPublished < 0)
+		return 0;
+	return &mFrames[mLastPublished];
+}
+
+const bool TripleBuffer::Acquire()
+{
+	if (!HasPending())
+		return false;
+	mFront = mMiddle.exchange(mFront, std::memory_order_acq_rel) & ~FRESH_BIT;
+	return true;
+}
+
+const Frame& TripleBuffer::GetFrontFrame() const
+{
+	return mFrames[mFront];
+}
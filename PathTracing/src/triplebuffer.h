@@ -0,0 +1,54 @@
+#ifndef __TRIPLEBUFFER_H__
+#define __TRIPLEBUFFER_H__
+
+#include <vector>
+#include <atomic>
+
+#include <glm/glm.hpp>
+
+struct Frame
+{
+	glm::ivec2 resolution;
+	// RGB8 rows
+	std::vector<unsigned char> pixels;
+	int version;
+
+	Frame() :
+		resolution(0),
+		version(-1)
+	{}
+};
+
+// Lock-free single producer / single consumer frame exchange. The producer fills the
+// back frame and publishes it, the consumer takes the newest published frame. Neither
+// side ever waits and a frame is never written while the other side can see it.
+class TripleBuffer
+{
+private:
+	// Set on the shared index while it holds a frame the consumer has not taken yet
+	static const int FRESH_BIT = 4;
+
+	Frame mFrames[3];
+	// Producer side
+	int mBack;
+	int mLastPublished;
+	// Consumer side
+	int mFront;
+	std::atomic<int> mMiddle;
+
+public:
+	TripleBuffer();
+
+	// Producer
+	Frame& GetBackFrame();
+	void Publish();
+	const bool HasPending() const;
+	// Last published frame, it stays untouched until the producer publishes again
+	const Frame* GetPublishedFrame() const;
+
+	// Consumer, returns false if nothing new was published since the last call
+	const bool Acquire();
+	const Frame& GetFrontFrame() const;
+};
+
+#endif